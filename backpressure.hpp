@@ -0,0 +1,165 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include <netinet/in.h>
+
+#include "buf_return_lane.hpp"
+#include "net.hpp"
+
+/* What the ring thread does with a packet when the worker queue is above its high watermark */
+enum class overflow_policy : uint8_t {
+    /* Only a full queue drops, the newest packet */
+    drop_newest,
+    /* Packets older than half of the watermark are skipped by the worker without processing */
+    drop_oldest,
+    /* The payload is copied into the secondary pool, so the provided buffer goes back to the ring at once */
+    copy,
+    /* Packets of clients which already have client_limit packets queued are dropped */
+    shed_client,
+};
+
+inline std::optional<overflow_policy> parse_overflow_policy(std::string_view name) {
+    if (name == "drop-newest")
+        return overflow_policy::drop_newest;
+    if (name == "drop-oldest")
+        return overflow_policy::drop_oldest;
+    if (name == "copy")
+        return overflow_policy::copy;
+    if (name == "shed-client")
+        return overflow_policy::shed_client;
+    return {};
+}
+
+struct backpressure_config {
+    overflow_policy policy = overflow_policy::drop_newest;
+    /* Queue occupancy from which the policy applies */
+    uint32_t high_watermark = 384;
+    /* Queued packets one client may have above the watermark with shed_client */
+    uint32_t client_limit = 8;
+};
+
+/* Outcome of every packet offered to a worker. All of them but dropped_oldest are counted by the ring thread */
+struct backpressure_metrics {
+    std::atomic<uint64_t> queued = 0;
+    std::atomic<uint64_t> copied = 0;
+    /* Queue full, or the secondary pool empty with copy */
+    std::atomic<uint64_t> dropped_newest = 0;
+    std::atomic<uint64_t> dropped_oldest = 0;
+    std::atomic<uint64_t> shed = 0;
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Secondary pool of fixed size slots the ring thread copies payloads into. The ring thread allocates, the worker
+ * frees through a return lane, so neither side takes a lock
+ */
+template <uint32_t Slots, uint32_t SlotSize>
+class copy_pool {
+public:
+    static constexpr auto slots = Slots;
+    static constexpr auto slot_size = SlotSize;
+
+    class buffer {
+    public:
+        buffer() = default;
+        buffer(copy_pool* ipool, uint32_t islot, uint32_t ilen): pool(ipool), slot(islot), len(ilen) {}
+
+        buffer(buffer&& b) noexcept: pool(b.pool), slot(b.slot), len(b.len) {
+            b.pool = nullptr;
+        }
+
+        buffer& operator=(buffer&& b) noexcept {
+            std::swap(pool, b.pool);
+            std::swap(slot, b.slot);
+            std::swap(len, b.len);
+            return *this;
+        }
+
+        ~buffer() {
+            if (pool)
+                pool->release(slot);
+        }
+
+        const uint8_t* data() const {
+            return pool->memory.get() + size_t(slot) * slot_size;
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+    private:
+        copy_pool* pool = nullptr;
+        uint32_t   slot = 0;
+        uint32_t   len = 0;
+    };
+
+    copy_pool(): memory(std::make_unique<uint8_t[]>(size_t(slots) * slot_size)) {
+        for (uint32_t i = 0; i < slots; ++i)
+            free_slots[i] = i;
+        free_count = slots;
+    }
+
+    /* Ring thread side, returns nothing if the pool is empty or the payload does not fit into a slot */
+    std::optional<buffer> copy(const uint8_t* data, size_t len) {
+        if (len > slot_size)
+            return {};
+
+        if (free_count == 0)
+            returned.drain([this](uint32_t slot) { free_slots[free_count++] = slot; });
+        if (free_count == 0)
+            return {};
+
+        auto slot = free_slots[--free_count];
+        memcpy(memory.get() + size_t(slot) * slot_size, data, len);
+        return buffer{this, slot, uint32_t(len)};
+    }
+
+private:
+    void release(uint32_t slot) {
+        returned.push(slot);
+    }
+
+    std::unique_ptr<uint8_t[]> memory;
+    uint32_t                   free_slots[slots];
+    uint32_t                   free_count = 0;
+
+    buf_return_lane<std::bit_ceil(slots)> returned;
+};
+
+/* Packets queued per client, clients are hashed into a fixed number of buckets */
+class client_shed_table {
+public:
+    static constexpr size_t buckets = 4096;
+
+    static size_t bucket(const sockaddr_in& src) {
+        return size_t(client_hash(src) >> 52);
+    }
+
+    uint32_t queued(size_t bucket) const {
+        return counts[bucket].load(std::memory_order_relaxed);
+    }
+
+    void add(size_t bucket) {
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void remove(size_t bucket) {
+        counts[bucket].fetch_sub(1, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<uint32_t>, buckets> counts = {};
+};
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include <iostream>
+#include <netinet/in.h>
+
+#include "session_router.hpp"
+
+/*
+ * Distribution of clients over the workers with session_router, for client populations shaped like real traffic:
+ *   random - random addresses and ports
+ *   subnet - consecutive addresses of a /16 with the same source port
+ *   nat    - one address, consecutive ports, as behind a carrier-grade NAT
+ * Prints the least and the most loaded worker against the mean and the cost of route() + done(). Exits with 1 if a
+ * worker deviates from the mean by more than --tolerance percent.
+ */
+
+struct bench_config {
+    size_t clients = 200000;
+    double tolerance = 5.0;
+};
+
+using population = std::vector<sockaddr_in>;
+
+population random_clients(size_t count) {
+    std::mt19937_64 rng(42);
+    population      clients(count);
+    for (auto& c : clients) {
+        c.sin_family = AF_INET;
+        c.sin_addr.s_addr = uint32_t(rng());
+        c.sin_port = uint16_t(rng());
+    }
+    return clients;
+}
+
+population subnet_clients(size_t count) {
+    population clients(count);
+    for (size_t i = 0; i < count; ++i) {
+        clients[i].sin_family = AF_INET;
+        clients[i].sin_addr.s_addr = htonl(0x0a000000 | uint32_t(i % 65536));
+        clients[i].sin_port = htons(uint16_t(50000 + i / 65536));
+    }
+    return clients;
+}
+
+population nat_clients(size_t count) {
+    population clients(count);
+    for (size_t i = 0; i < count; ++i) {
+        clients[i].sin_family = AF_INET;
+        clients[i].sin_addr.s_addr = htonl(0xc6336401 + uint32_t(i / 64512));
+        clients[i].sin_port = htons(uint16_t(1024 + i % 64512));
+    }
+    return clients;
+}
+
+/* Returns the largest deviation from the mean in percent */
+double check(std::string_view name, const population& clients, uint32_t workers) {
+    session_router        router(workers);
+    std::vector<uint64_t> load(workers, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto& c : clients) {
+        auto bucket = session_router::bucket(c);
+        ++load[router.route(bucket)];
+        router.done(bucket);
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    auto mean = double(clients.size()) / workers;
+    auto [min, max] = std::minmax_element(load.begin(), load.end());
+    auto deviation = std::max(mean - double(*min), double(*max) - mean) / mean * 100.0;
+
+    printf("%-7s %2u workers  min %7zu  max %7zu  mean %9.1f  deviation %5.2f%%  route %5.1f ns\n",
+           name.data(),
+           workers,
+           *min,
+           *max,
+           mean,
+           deviation,
+           ns / double(clients.size()));
+    return deviation;
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--clients N] [--tolerance PERCENT]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--clients")
+            cfg.clients = std::stoul(argv[++i]);
+        else if (arg == "--tolerance")
+            cfg.tolerance = std::stod(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    struct named_population {
+        const char* name;
+        population  clients;
+    };
+    named_population populations[] = {
+        {"random", random_clients(cfg.clients)},
+        {"subnet", subnet_clients(cfg.clients)},
+        {"nat", nat_clients(cfg.clients)},
+    };
+
+    double worst = 0;
+    for (auto& p : populations)
+        for (uint32_t workers : {2u, 3u, 4u, 6u, 8u, 16u})
+            worst = std::max(worst, check(p.name, p.clients, workers));
+
+    if (worst > cfg.tolerance) {
+        printf("uneven: worst deviation %.2f%% above the tolerance of %.2f%%\n", worst, cfg.tolerance);
+        return 1;
+    }
+}
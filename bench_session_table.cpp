@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <iostream>
+#include <netinet/in.h>
+
+#include "session_router.hpp"
+#include "session_table.hpp"
+
+/*
+ * Per-packet session lookup of session_table against std::unordered_map: a stream of packets from a population of
+ * clients is looked up and counted, as the worker does for every packet.
+ *   hit    - every client has a session already
+ *   churn  - a quarter of the packets come from new clients, the oldest sessions are expired to make room. The
+ *            stream is replayed --churn-rounds times and only the last round is timed, by then the table has
+ *            turned over many times and its tombstones are at steady state
+ *   miss   - lookups of clients without a session
+ *   routed - as hit, but every client is one session_router sends to worker 0 of --routed-workers, the keys a
+ *            worker's table sees with session affinity
+ */
+
+struct bench_config {
+    size_t clients = 100000;
+    size_t packets = 10000000;
+    size_t churn_rounds = 4;
+    size_t routed_workers = 4;
+};
+
+struct session_state {
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+std::vector<uint64_t> make_keys(size_t count, uint64_t seed) {
+    std::mt19937_64       rng(seed);
+    std::vector<uint64_t> keys(count);
+    for (auto& k : keys)
+        k = rng() & 0xffffffffffff;
+    return keys;
+}
+
+/* Keys of clients session_router routes to worker 0 of workers */
+std::vector<uint64_t> make_routed_keys(size_t count, size_t workers, uint64_t seed) {
+    std::mt19937_64       rng(seed);
+    std::vector<uint64_t> keys;
+    keys.reserve(count);
+    while (keys.size() < count) {
+        auto        key = rng() & 0xffffffffffff;
+        sockaddr_in src{};
+        src.sin_addr.s_addr = uint32_t(key >> 16);
+        src.sin_port = uint16_t(key);
+        if (session_router::bucket(src) % workers == 0)
+            keys.push_back(endpoint_key(src));
+    }
+    return keys;
+}
+
+/* Packet i comes from client stream[i] */
+std::vector<uint32_t> make_stream(size_t packets, size_t clients) {
+    std::mt19937_64                         rng(7);
+    std::uniform_int_distribution<uint32_t> pick(0, uint32_t(clients - 1));
+    std::vector<uint32_t>                   stream(packets);
+    for (auto& s : stream)
+        s = pick(rng);
+    return stream;
+}
+
+struct flat_table {
+    session_table<session_state> table;
+
+    explicit flat_table(size_t capacity): table(capacity) {}
+
+    session_state* touch(uint64_t key, int64_t now) {
+        return table.touch(key, now);
+    }
+
+    session_state* find(uint64_t key) {
+        return table.find(key);
+    }
+
+    void expire(int64_t now, int64_t idle) {
+        table.expire(now, idle, 256);
+    }
+};
+
+/* What a server without a dedicated table would write */
+struct std_table {
+    struct entry {
+        session_state state;
+        int64_t       last_seen;
+    };
+    std::unordered_map<uint64_t, entry> table;
+    std::unordered_map<uint64_t, entry>::iterator expire_cursor = table.end();
+
+    explicit std_table(size_t capacity) {
+        table.reserve(capacity);
+    }
+
+    session_state* touch(uint64_t key, int64_t now) {
+        auto& e = table[key];
+        e.last_seen = now;
+        return &e.state;
+    }
+
+    session_state* find(uint64_t key) {
+        auto it = table.find(key);
+        return it == table.end() ? nullptr : &it->second.state;
+    }
+
+    void expire(int64_t now, int64_t idle) {
+        for (int i = 0; i < 64 && !table.empty(); ++i) {
+            if (expire_cursor == table.end())
+                expire_cursor = table.begin();
+            if (now - expire_cursor->second.last_seen > idle)
+                expire_cursor = table.erase(expire_cursor);
+            else
+                ++expire_cursor;
+        }
+    }
+};
+
+template <typename T>
+double run_hit(const bench_config& cfg, const std::vector<uint64_t>& keys, const std::vector<uint32_t>& stream) {
+    T table(cfg.clients);
+    for (auto k : keys)
+        table.touch(k, 0);
+
+    uint64_t sum = 0;
+    auto     start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < stream.size(); ++i) {
+        auto s = table.touch(keys[stream[i]], int64_t(i));
+        sum += ++s->packets;
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (sum == 0)
+        std::cerr << "no packets counted" << std::endl;
+    return ns / double(stream.size());
+}
+
+template <typename T>
+double run_churn(const bench_config& cfg, const std::vector<uint64_t>& keys, const std::vector<uint32_t>& stream) {
+    T table(cfg.clients * 2);
+    for (auto k : keys)
+        table.touch(k, 0);
+
+    uint64_t next_new = uint64_t(1) << 48;
+    uint64_t sum = 0;
+
+    std::chrono::steady_clock::time_point start;
+    for (size_t round = 0; round < cfg.churn_rounds; ++round) {
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < stream.size(); ++i) {
+            auto now = int64_t(round * stream.size() + i);
+            auto key = i % 4 == 0 ? next_new++ : keys[stream[i]];
+            if (auto s = table.touch(key, now))
+                sum += ++s->packets;
+            if (i % 64 == 0)
+                table.expire(now, int64_t(cfg.clients) * 4);
+        }
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (sum == 0)
+        std::cerr << "no packets counted" << std::endl;
+    return ns / double(stream.size());
+}
+
+template <typename T>
+double run_miss(const bench_config& cfg, const std::vector<uint64_t>& keys, const std::vector<uint32_t>& stream) {
+    T table(cfg.clients);
+    for (auto k : keys)
+        table.touch(k, 0);
+
+    auto     absent = make_keys(cfg.clients, 99);
+    uint64_t found = 0;
+    auto     start = std::chrono::steady_clock::now();
+    for (auto s : stream)
+        found += table.find(absent[s] | uint64_t(1) << 48) != nullptr;
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (found)
+        std::cerr << found << " absent keys found" << std::endl;
+    return ns / double(stream.size());
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--clients N] [--packets N] [--churn-rounds N] [--routed-workers N]"
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--clients")
+            cfg.clients = std::max<size_t>(std::stoul(argv[++i]), 1);
+        else if (arg == "--packets")
+            cfg.packets = std::stoul(argv[++i]);
+        else if (arg == "--churn-rounds")
+            cfg.churn_rounds = std::max<size_t>(std::stoul(argv[++i]), 1);
+        else if (arg == "--routed-workers")
+            cfg.routed_workers = std::max<size_t>(std::stoul(argv[++i]), 1);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    auto keys = make_keys(cfg.clients, 1);
+    auto stream = make_stream(cfg.packets, cfg.clients);
+
+    printf("%zu clients, %zu packets, ns per packet\n", cfg.clients, cfg.packets);
+    printf("%-6s  session_table %6.1f  unordered_map %6.1f\n",
+           "hit",
+           run_hit<flat_table>(cfg, keys, stream),
+           run_hit<std_table>(cfg, keys, stream));
+    printf("%-6s  session_table %6.1f  unordered_map %6.1f\n",
+           "churn",
+           run_churn<flat_table>(cfg, keys, stream),
+           run_churn<std_table>(cfg, keys, stream));
+    printf("%-6s  session_table %6.1f  unordered_map %6.1f\n",
+           "miss",
+           run_miss<flat_table>(cfg, keys, stream),
+           run_miss<std_table>(cfg, keys, stream));
+
+    auto routed = make_routed_keys(cfg.clients, cfg.routed_workers, 3);
+    printf("%-6s  session_table %6.1f  unordered_map %6.1f\n",
+           "routed",
+           run_hit<flat_table>(cfg, routed, stream),
+           run_hit<std_table>(cfg, routed, stream));
+}
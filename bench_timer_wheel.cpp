@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include <iostream>
+
+#include "timer_wheel.hpp"
+
+/*
+ * A million armed per-session timers in timer_wheel against a std::multimap ordered by expiry (one allocation per
+ * timer, iterator kept for cancellation):
+ *   add       - arm every timer with a random delay up to --max-delay ticks
+ *   resched   - re-arm a quarter of them, as a keepalive or resend timer is pushed back on every packet
+ *   cancel    - cancel another quarter, as sessions disconnect
+ *   advance   - tick until every timer has fired, the cost per tick and per fired timer
+ */
+
+struct bench_config {
+    size_t   timers = 1000000;
+    uint64_t max_delay = 1 << 18;
+};
+
+struct session_timer {
+    timer_node node;
+    uint64_t   fired = 0;
+};
+
+uint64_t fired_total = 0;
+
+void on_timer(timer_node& node) {
+    auto& t = *reinterpret_cast<session_timer*>(&node);
+    ++t.fired;
+    ++fired_total;
+}
+
+struct wheel_timers {
+    timer_wheel                wheel;
+    std::vector<session_timer> timers;
+
+    explicit wheel_timers(size_t count): timers(count) {}
+
+    void add(size_t i, uint64_t delay) {
+        wheel.add(timers[i].node, delay, on_timer);
+    }
+
+    void cancel(size_t i) {
+        wheel.cancel(timers[i].node);
+    }
+
+    void advance() {
+        wheel.advance(wheel.now() + 1);
+    }
+
+    size_t size() const {
+        return wheel.size();
+    }
+};
+
+struct multimap_timers {
+    using map_type = std::multimap<uint64_t, size_t>;
+
+    map_type                        map;
+    std::vector<map_type::iterator> its;
+    uint64_t                        now = 0;
+
+    explicit multimap_timers(size_t count): its(count, map.end()) {}
+
+    void add(size_t i, uint64_t delay) {
+        cancel(i);
+        its[i] = map.emplace(now + (delay ? delay : 1), i);
+    }
+
+    void cancel(size_t i) {
+        if (its[i] == map.end())
+            return;
+        map.erase(its[i]);
+        its[i] = map.end();
+    }
+
+    void advance() {
+        ++now;
+        while (!map.empty() && map.begin()->first <= now) {
+            its[map.begin()->second] = map.end();
+            map.erase(map.begin());
+            ++fired_total;
+        }
+    }
+
+    size_t size() const {
+        return map.size();
+    }
+};
+
+double elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename T>
+void bench(std::string_view name, const bench_config& cfg) {
+    std::mt19937_64                         rng(1);
+    std::uniform_int_distribution<uint64_t> delay(1, cfg.max_delay);
+
+    std::vector<uint64_t> delays(cfg.timers);
+    for (auto& d : delays)
+        d = delay(rng);
+
+    T    timers(cfg.timers);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < cfg.timers; ++i)
+        timers.add(i, delays[i]);
+    auto add_ns = elapsed_ns(start) / double(cfg.timers);
+
+    auto quarter = cfg.timers / 4;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < quarter; ++i)
+        timers.add(i, delays[cfg.timers - 1 - i]);
+    auto resched_ns = elapsed_ns(start) / double(quarter);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = quarter; i < quarter * 2; ++i)
+        timers.cancel(i);
+    auto cancel_ns = elapsed_ns(start) / double(quarter);
+
+    fired_total = 0;
+    auto   armed = timers.size();
+    size_t ticks = 0;
+    start = std::chrono::steady_clock::now();
+    while (timers.size()) {
+        timers.advance();
+        ++ticks;
+    }
+    auto advance_ns = elapsed_ns(start);
+
+    printf("%-9s %zu timers  add %6.1f ns  resched %6.1f ns  cancel %6.1f ns  advance %6.1f ns/tick %6.1f ns/fired"
+           "  (%zu of %zu fired)\n",
+           name.data(),
+           cfg.timers,
+           add_ns,
+           resched_ns,
+           cancel_ns,
+           advance_ns / double(ticks),
+           advance_ns / double(fired_total ? fired_total : 1),
+           size_t(fired_total),
+           armed);
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--timers N] [--max-delay TICKS]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--timers")
+            cfg.timers = std::stoul(argv[++i]);
+        else if (arg == "--max-delay")
+            cfg.max_delay = std::max<uint64_t>(std::stoul(argv[++i]), 1);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bench<wheel_timers>("wheel", cfg);
+    bench<multimap_timers>("multimap", cfg);
+}
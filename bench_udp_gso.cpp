@@ -0,0 +1,235 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_util.hpp"
+#include "io_uring_ctx.hpp"
+#include "net.hpp"
+
+/*
+ * Sends per-tick client updates over loopback: every tick each client gets `burst` datagrams of `size` bytes.
+ *   plain - one sendto() syscall per datagram, like the non-zerocopy mode of send-zerocopy.c
+ *   uring - one sendmsg SQE per datagram, one io_uring_enter() per tick
+ *   gso   - the burst of each client is packed into one UDP_SEGMENT sendmsg SQE
+ * Receivers are drained by a separate thread, so the numbers include the loopback receive path.
+ */
+
+struct bench_config {
+    size_t count = 1000000;
+    size_t size = 1400;
+    size_t clients = 64;
+    size_t burst = 8;
+};
+
+struct bench_result {
+    uint64_t datagrams;
+    uint64_t received;
+    uint64_t syscalls;
+    uint64_t sqes;
+    double   wall_ns;
+    double   cpu_ns;
+};
+
+class receivers {
+public:
+    explicit receivers(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            int rcvbuf = 8 << 20;
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+            sockaddr_in addr{
+                .sin_family = AF_INET,
+                .sin_port   = 0,
+                .sin_addr   = {htonl(INADDR_LOOPBACK)},
+            };
+            socklen_t len = sizeof(addr);
+            if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == -1 || getsockname(sock, (sockaddr*)&addr, &len) == -1)
+                throw std::runtime_error("receiver setup failed: " + std::string(strerror(errno)));
+
+            fds.push_back({.fd = sock, .events = POLLIN});
+            addrs.push_back(addr);
+        }
+        t = std::thread(&receivers::run, this);
+    }
+
+    ~receivers() {
+        stop = true;
+        t.join();
+        for (auto& fd : fds)
+            close(fd.fd);
+    }
+
+    const std::vector<sockaddr_in>& destinations() const {
+        return addrs;
+    }
+
+    uint64_t received() const {
+        return count.load();
+    }
+
+private:
+    void run() {
+        char buf[65536];
+        while (!stop) {
+            if (poll(fds.data(), fds.size(), 10) <= 0)
+                continue;
+            for (auto& fd : fds)
+                while (recv(fd.fd, buf, sizeof(buf), 0) > 0)
+                    count.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::vector<pollfd>      fds;
+    std::vector<sockaddr_in> addrs;
+    std::atomic<uint64_t>    count = 0;
+    std::atomic<bool>        stop = false;
+    std::thread              t;
+};
+
+template <typename F>
+bench_result measure(const bench_config& cfg, F&& send_all) {
+    receivers rcv(cfg.clients);
+
+    auto start_cpu = thread_cpu_ns();
+    auto start = std::chrono::steady_clock::now();
+    auto [syscalls, sqes] = send_all(rcv.destinations());
+    auto wall = std::chrono::steady_clock::now() - start;
+    auto cpu = thread_cpu_ns() - start_cpu;
+
+    /* Let the receiver drain the socket buffers */
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    auto ticks = cfg.count / (cfg.clients * cfg.burst);
+    return {
+        .datagrams = ticks * cfg.clients * cfg.burst,
+        .received  = rcv.received(),
+        .syscalls  = syscalls,
+        .sqes      = sqes,
+        .wall_ns   = double(std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count()),
+        .cpu_ns    = double(cpu),
+    };
+}
+
+bench_result bench_plain(const bench_config& cfg, const std::vector<uint8_t>& payload) {
+    return measure(cfg, [&](const std::vector<sockaddr_in>& dsts) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        uint64_t syscalls = 0;
+        auto     ticks = cfg.count / (cfg.clients * cfg.burst);
+        for (size_t tick = 0; tick < ticks; ++tick)
+            for (auto& dst : dsts)
+                for (size_t i = 0; i < cfg.burst; ++i, ++syscalls)
+                    if (sendto(sock, payload.data(), payload.size(), 0, (const sockaddr*)&dst, sizeof(dst)) == -1)
+                        std::cerr << "sendto() failed: " << strerror(errno) << std::endl;
+
+        close(sock);
+        return std::pair{syscalls, uint64_t(0)};
+    });
+}
+
+template <uring_settings settings>
+bench_result bench_uring(const bench_config& cfg, const std::vector<uint8_t>& payload) {
+    return measure(cfg, [&](const std::vector<sockaddr_in>& dsts) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        io_uring_ctx ctx(type_c<settings>{}, [](sockaddr_in*, auto&&) {});
+        ctx.register_files(&sock, 1);
+        if (settings.udp_gso && !ctx.gso_active())
+            std::cerr << "UDP GSO is not supported by the kernel, measuring the fallback" << std::endl;
+
+        auto ticks = cfg.count / (cfg.clients * cfg.burst);
+        for (size_t tick = 0; tick < ticks; ++tick) {
+            for (auto& dst : dsts) {
+                for (size_t i = 0; i < cfg.burst; ++i) {
+                    int rc;
+                    while ((rc = ctx.send_to(0, dst, payload.data(), payload.size())) == -EAGAIN)
+                        ctx.run_once(1);
+                    if (rc)
+                        std::cerr << "send_to() failed: " << strerror(-rc) << std::endl;
+                }
+            }
+            ctx.run_once(0);
+        }
+
+        while (ctx.sends_in_flight())
+            ctx.run_once(1);
+
+        auto& stats = ctx.stats();
+        close(sock);
+        return std::pair{stats.submits, stats.sends_completed + stats.send_errors};
+    });
+}
+
+void print(std::string_view name, const bench_result& r) {
+    auto n = double(r.datagrams);
+    printf("%-6s datagrams %9zu  received %9zu  wall %7.1f ns/pkt  cpu %7.1f ns/pkt  syscalls/pkt %.3f  sqes/pkt %.3f  "
+           "%.2f Mpps\n",
+           name.data(),
+           r.datagrams,
+           r.received,
+           r.wall_ns / n,
+           r.cpu_ns / n,
+           double(r.syscalls) / n,
+           double(r.sqes) / n,
+           n / r.wall_ns * 1e3);
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--count N] [--size BYTES] [--clients N] [--burst N]\n"
+              << "  --burst N  datagrams sent to each client per tick (packed into one GSO send)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--count")
+            cfg.count = std::stoul(argv[++i]);
+        else if (arg == "--size")
+            cfg.size = std::stoul(argv[++i]);
+        else if (arg == "--clients")
+            cfg.clients = std::stoul(argv[++i]);
+        else if (arg == "--burst")
+            cfg.burst = std::stoul(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (cfg.size == 0 || cfg.size > 1472 || cfg.burst == 0 || cfg.clients == 0) {
+        std::cerr << "size must be in [1, 1472], burst and clients must be positive" << std::endl;
+        return 1;
+    }
+
+    printf("udp gso supported: %s, %zu clients x %zu datagrams of %zu bytes per tick\n",
+           udp_gso_supported() ? "yes" : "no",
+           cfg.clients,
+           cfg.burst,
+           cfg.size);
+
+    std::vector<uint8_t> payload(cfg.size, 'x');
+
+    constexpr uring_settings uring_cfg{.sq_depth = 256, .send_depth = 1024, .send_buf_size = 2048};
+    constexpr uring_settings gso_cfg{.sq_depth = 256, .send_depth = 1024, .send_buf_size = 65507, .udp_gso = true};
+
+    print("plain", bench_plain(cfg, payload));
+    print("uring", bench_uring<uring_cfg>(cfg, payload));
+    print("gso", bench_uring<gso_cfg>(cfg, payload));
+}
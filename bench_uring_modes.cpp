@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench_util.hpp"
+#include "io_uring_ctx.hpp"
+
+/*
+ * Receives loopback datagrams with differently configured rings:
+ *   throughput - a sender floods the socket, pps is counted between the first and the last received datagram
+ *   latency    - datagrams are paced and carry their send time, the receive handler measures the time from
+ *                sendto() to the CQE being processed
+ * The sender and the ring thread are pinned to --sender-cpu and --ring-cpu when given.
+ */
+
+struct bench_config {
+    size_t count = 1000000;
+    size_t latency_count = 100000;
+    /* Pause between the paced datagrams of the latency run */
+    std::chrono::nanoseconds interval = std::chrono::microseconds(20);
+    int ring_cpu = -1;
+    int sender_cpu = -1;
+};
+
+struct probe {
+    uint64_t seq;
+    int64_t  sent_ns;
+};
+
+/* A probe with this seq ends the run */
+constexpr uint64_t stop_seq = UINT64_MAX;
+
+void send_probes(const bench_config& cfg, sockaddr_in dst, size_t count, std::chrono::nanoseconds interval) {
+    pin(cfg.sender_cpu);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    for (uint64_t seq = 0; seq < count; ++seq) {
+        probe p{.seq = seq, .sent_ns = now_ns()};
+        sendto(sock, &p, sizeof(p), 0, (const sockaddr*)&dst, sizeof(dst));
+
+        if (interval.count())
+            while (now_ns() - p.sent_ns < interval.count())
+                ;
+    }
+
+    /* The receive queue may be full right after the flood: repeat the stop probe until the ring has seen it */
+    for (int i = 0; i < 100; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        probe p{.seq = stop_seq, .sent_ns = now_ns()};
+        sendto(sock, &p, sizeof(p), 0, (const sockaddr*)&dst, sizeof(dst));
+    }
+    close(sock);
+}
+
+struct run_result {
+    uint64_t              received = 0;
+    int64_t               first_ns = 0;
+    int64_t               last_ns = 0;
+    std::vector<uint32_t> latencies;
+    ring_metrics          metrics;
+};
+
+template <uring_settings settings>
+run_result run(const bench_config& cfg, size_t count, std::chrono::nanoseconds interval) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 8 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    sockaddr_in addr{
+        .sin_family = AF_INET,
+        .sin_port   = 0,
+        .sin_addr   = {htonl(INADDR_LOOPBACK)},
+    };
+    socklen_t len = sizeof(addr);
+    if (bind(sock, (sockaddr*)&addr, sizeof(addr)) == -1 || getsockname(sock, (sockaddr*)&addr, &len) == -1)
+        throw std::runtime_error("socket setup failed: " + std::string(strerror(errno)));
+
+    run_result result;
+    result.latencies.reserve(interval.count() ? count : 0);
+    bool done = false;
+
+    /* The ring is created by the thread which drives it, as single_issuer requires */
+    pin(cfg.ring_cpu);
+    io_uring_ctx ctx(type_c<settings>{}, [&](sockaddr_in*, auto&& buf) {
+        auto now = now_ns();
+        if (buf.size() != sizeof(probe))
+            return;
+
+        probe p;
+        memcpy(&p, buf.data(), sizeof(p));
+        if (p.seq == stop_seq) {
+            done = true;
+            return;
+        }
+
+        if (result.received++ == 0)
+            result.first_ns = now;
+        result.last_ns = now;
+        if (interval.count())
+            result.latencies.push_back(uint32_t(std::min<int64_t>(now - p.sent_ns, UINT32_MAX)));
+    });
+    ctx.register_files(&sock, 1);
+
+    std::thread sender(send_probes, std::cref(cfg), addr, count, interval);
+    ctx.add_recv_request(0);
+    while (!done)
+        if (ctx.run_once() < 0)
+            break;
+    sender.join();
+
+    result.metrics = ctx.stats();
+    close(sock);
+    return result;
+}
+
+template <uring_settings settings>
+void bench(std::string_view name, const bench_config& cfg) {
+    auto tp = run<settings>(cfg, cfg.count, std::chrono::nanoseconds(0));
+    auto lat = run<settings>(cfg, cfg.latency_count, cfg.interval);
+
+    auto seconds = double(tp.last_ns - tp.first_ns) / 1e9;
+    printf("%-14s received %8zu/%zu  %6.3f Mpps  submits/cqe %.3f  latency p50 %6u ns  p99 %6u ns  p99.9 %6u ns\n",
+           name.data(),
+           tp.received,
+           cfg.count,
+           seconds > 0 ? double(tp.received) / seconds / 1e6 : 0.0,
+           tp.received ? double(tp.metrics.submits) / double(tp.received) : 0.0,
+           percentile(lat.latencies, 0.5),
+           percentile(lat.latencies, 0.99),
+           percentile(lat.latencies, 0.999));
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0
+              << " [--count N] [--latency-count N] [--interval-us US] [--ring-cpu CPU] [--sender-cpu CPU]\n"
+              << "  --interval-us US  pause between the datagrams of the latency run" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--count")
+            cfg.count = std::stoul(argv[++i]);
+        else if (arg == "--latency-count")
+            cfg.latency_count = std::stoul(argv[++i]);
+        else if (arg == "--interval-us")
+            cfg.interval = std::chrono::microseconds(std::stoul(argv[++i]));
+        else if (arg == "--ring-cpu")
+            cfg.ring_cpu = std::stoi(argv[++i]);
+        else if (arg == "--sender-cpu")
+            cfg.sender_cpu = std::stoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    constexpr uring_settings single_issuer{.single_issuer = true};
+    constexpr uring_settings defer_taskrun{.single_issuer = true, .defer_taskrun = true};
+    constexpr uring_settings defer_regfd{.single_issuer = true, .defer_taskrun = true, .register_ring_fd = true};
+    constexpr uring_settings sqpoll{.sqpoll = true};
+
+    try {
+        bench<uring_settings{}>("default", cfg);
+        bench<single_issuer>("single-issuer", cfg);
+        bench<defer_taskrun>("defer-taskrun", cfg);
+        bench<defer_regfd>("defer+regfd", cfg);
+        bench<sqpoll>("sqpoll", cfg);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
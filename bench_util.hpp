@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#include <iostream>
+
+#include "cpu_affinity.hpp"
+
+/* Helpers shared by the bench_* programs */
+
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* CPU time of the calling thread, user and system */
+inline int64_t thread_cpu_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Pins the calling thread unless cpu is negative, a failure is only reported */
+inline void pin(int cpu) {
+    if (cpu < 0)
+        return;
+
+    if (auto rc = pin_thread_to_cpu(cpu))
+        std::cerr << "cannot pin to cpu " << cpu << ": " << strerror(rc) << std::endl;
+}
+
+/* p in 0..1, reorders values */
+inline uint32_t percentile(std::vector<uint32_t>& values, double p) {
+    if (values.empty())
+        return 0;
+    auto nth = values.begin() + ptrdiff_t(double(values.size() - 1) * p);
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
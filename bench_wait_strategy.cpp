@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <iostream>
+
+#include "bench_util.hpp"
+#include "rigtorp/SPSCQueue.h"
+#include "wait_strategy.hpp"
+
+/*
+ * Latency against CPU of the worker wait strategies. A producer thread plays the ring thread: it pushes timestamps
+ * into an SPSC queue at a fixed rate and notifies the waiter, the consumer measures the time from the push to the
+ * pop. The CPU time of the consumer thread over the run shows what idling costs at every load.
+ */
+
+struct bench_config {
+    std::chrono::milliseconds duration = std::chrono::milliseconds(1000);
+    int producer_cpu = -1;
+    int consumer_cpu = -1;
+};
+
+/* Ends the run */
+constexpr int64_t stop_mark = -1;
+
+struct run_result {
+    std::vector<uint32_t> latencies;
+    int64_t               cpu_ns = 0;
+    int64_t               wall_ns = 0;
+    uint64_t              parks = 0;
+};
+
+run_result run(const bench_config& cfg, wait_config wait, uint64_t rate) {
+    rigtorp::SPSCQueue<int64_t> queue(4096);
+    idle_waiter                 waiter(wait);
+
+    run_result result;
+    result.latencies.reserve(size_t(rate * uint64_t(cfg.duration.count()) / 1000));
+
+    std::thread consumer([&] {
+        pin(cfg.consumer_cpu);
+        auto cpu_start = thread_cpu_ns();
+        auto wall_start = now_ns();
+
+        while (true) {
+            waiter.wait([&] { return queue.front() != nullptr; });
+            auto sent = *queue.front();
+            queue.pop();
+            if (sent == stop_mark)
+                break;
+            result.latencies.push_back(uint32_t(std::min<int64_t>(now_ns() - sent, UINT32_MAX)));
+        }
+
+        result.cpu_ns = thread_cpu_ns() - cpu_start;
+        result.wall_ns = now_ns() - wall_start;
+    });
+
+    pin(cfg.producer_cpu);
+    auto interval = int64_t(1000000000 / rate);
+    auto end = now_ns() + std::chrono::nanoseconds(cfg.duration).count();
+    for (auto next = now_ns(); next < end; next += interval) {
+        while (now_ns() < next)
+            ;
+        if (queue.try_emplace(now_ns()))
+            waiter.notify();
+    }
+    queue.emplace(stop_mark);
+    waiter.notify();
+
+    consumer.join();
+    result.parks = waiter.parks_count();
+    return result;
+}
+
+void bench(std::string_view name, const bench_config& cfg, wait_config wait) {
+    struct load {
+        const char* name;
+        uint64_t    rate;
+    };
+    constexpr load loads[] = {{"low", 1000}, {"medium", 50000}, {"high", 1000000}};
+
+    for (auto& l : loads) {
+        auto r = run(cfg, wait, l.rate);
+        printf("%-20s %-6s %8zu msgs  latency p50 %7u ns  p99 %7u ns  p99.9 %7u ns  consumer cpu %5.1f%%  parks %zu\n",
+               name.data(),
+               l.name,
+               r.latencies.size(),
+               percentile(r.latencies, 0.5),
+               percentile(r.latencies, 0.99),
+               percentile(r.latencies, 0.999),
+               r.wall_ns ? double(r.cpu_ns) * 100.0 / double(r.wall_ns) : 0.0,
+               r.parks);
+    }
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--duration-ms MS] [--producer-cpu CPU] [--consumer-cpu CPU]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--duration-ms")
+            cfg.duration = std::chrono::milliseconds(std::stoul(argv[++i]));
+        else if (arg == "--producer-cpu")
+            cfg.producer_cpu = std::stoi(argv[++i]);
+        else if (arg == "--consumer-cpu")
+            cfg.consumer_cpu = std::stoi(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    try {
+        /* What worker::run did before: sched_yield() forever */
+        bench("yield", cfg, {.spin = 0, .yield = 0, .park = park_mode::none});
+        bench("spin+yield+futex", cfg, {});
+        bench("spin+yield+eventfd", cfg, {.park = park_mode::eventfd});
+        bench("futex", cfg, {.spin = 0, .yield = 0, .park = park_mode::futex});
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/*
+ * Bounded lock-free queue of buffer ids given back by worker threads to the ring thread: Vyukov's MPMC queue
+ * restricted to one consumer. A lane normally has a single producer, threads beyond the lane count share lanes, which
+ * the per-cell sequence numbers make safe without locks.
+ */
+template <uint32_t Capacity>
+class buf_return_lane {
+public:
+    static constexpr uint32_t capacity = Capacity;
+    static_assert(capacity != 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+    buf_return_lane(): cells(std::make_unique<cell[]>(capacity)) {
+        for (uint32_t i = 0; i < capacity; ++i)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    buf_return_lane(const buf_return_lane&) = delete;
+    buf_return_lane& operator=(const buf_return_lane&) = delete;
+
+    /* Returns false if the lane is full */
+    bool push(uint32_t id) {
+        auto pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = cells[pos & (capacity - 1)];
+            auto  seq = c.seq.load(std::memory_order_acquire);
+            auto  diff = int32_t(seq - pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+
+        auto& c = cells[pos & (capacity - 1)];
+        c.id = id;
+        c.seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer side: calls f(id) for every id pushed so far, returns their count */
+    template <typename F>
+    uint32_t drain(F&& f) {
+        uint32_t count = 0;
+        while (true) {
+            auto& c = cells[head & (capacity - 1)];
+            if (c.seq.load(std::memory_order_acquire) != head + 1)
+                break;
+
+            f(c.id);
+            c.seq.store(head + capacity, std::memory_order_release);
+            ++head;
+            ++count;
+        }
+        return count;
+    }
+
+private:
+    struct cell {
+        std::atomic<uint32_t> seq;
+        uint32_t              id;
+    };
+
+    std::unique_ptr<cell[]> cells;
+
+    alignas(64) std::atomic<uint32_t> tail = 0;
+    alignas(64) uint32_t head = 0;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+/* CPUs the process may run on, empty if sched_getaffinity() fails */
+inline std::vector<int> allowed_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+        return {};
+
+    std::vector<int> cpus;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(int(cpu));
+    return cpus;
+}
+
+/* "0,2,4" */
+inline std::vector<int> parse_cpu_list(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+        auto comma = list.find(',');
+        cpus.push_back(std::stoi(std::string(list.substr(0, comma))));
+        list = comma == list.npos ? std::string_view{} : list.substr(comma + 1);
+    }
+    return cpus;
+}
+
+/* Returns 0 or the error of pthread_setaffinity_np() */
+inline int pin_thread_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(size_t(cpu), &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
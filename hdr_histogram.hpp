@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Bucket layout of hdr_histogram: values below 2 * sub_buckets have a bucket each, above that every power of two
+ * range is split into sub_buckets linear buckets, so a value is known within 1 / sub_buckets of itself (3% with
+ * 5 sub bits) from 1ns to max_value in a few KB
+ */
+template <unsigned SubBits = 5, unsigned MaxBits = 40>
+struct hdr_layout {
+    static constexpr unsigned sub_bits = SubBits;
+    static constexpr size_t   sub_buckets = size_t(1) << SubBits;
+    static constexpr uint64_t max_value = (uint64_t(1) << MaxBits) - 1;
+    static constexpr size_t   buckets = (MaxBits - SubBits + 1) * sub_buckets;
+
+    static_assert(SubBits >= 1 && MaxBits > SubBits + 1 && MaxBits <= 63);
+
+    static size_t index(uint64_t value) {
+        value = std::min(value, max_value);
+        if (value < 2 * sub_buckets)
+            return size_t(value);
+
+        auto shift = unsigned(std::bit_width(value)) - sub_bits - 1;
+        return (shift + 1) * sub_buckets + size_t(value >> shift) - sub_buckets;
+    }
+
+    /* Largest value recorded into the bucket */
+    static uint64_t highest(size_t idx) {
+        if (idx < 2 * sub_buckets)
+            return idx;
+
+        auto shift = unsigned(idx / sub_buckets) - 1;
+        auto mantissa = uint64_t(idx % sub_buckets + sub_buckets);
+        return ((mantissa + 1) << shift) - 1;
+    }
+};
+
+/* Counts copied out of an hdr_histogram, the difference of two snapshots covers the interval between them */
+template <typename Layout = hdr_layout<>>
+struct hdr_snapshot {
+    std::array<uint64_t, Layout::buckets> counts = {};
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (auto c : counts)
+            sum += c;
+        return sum;
+    }
+
+    /* Smallest value which at least fraction q (0..1) of the recorded values do not exceed, 0 if empty */
+    uint64_t quantile(double q) const {
+        auto total_count = total();
+        if (total_count == 0)
+            return 0;
+
+        auto     rank = std::max<uint64_t>(uint64_t(q * double(total_count) + 0.5), 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank)
+                return Layout::highest(i);
+        }
+        return Layout::max_value;
+    }
+
+    uint64_t max() const {
+        for (size_t i = counts.size(); i > 0; --i)
+            if (counts[i - 1])
+                return Layout::highest(i - 1);
+        return 0;
+    }
+
+    hdr_snapshot operator-(const hdr_snapshot& prev) const {
+        hdr_snapshot diff;
+        for (size_t i = 0; i < counts.size(); ++i)
+            diff.counts[i] = counts[i] - prev.counts[i];
+        return diff;
+    }
+};
+
+/*
+ * HdrHistogram-style latency histogram of nanosecond values: fixed size, never allocates, record() is a relaxed
+ * fetch_add and may be called by any number of threads. Readers take snapshots while it is written, a snapshot may
+ * miss the values recorded during the copy
+ */
+template <typename Layout = hdr_layout<>>
+class hdr_histogram {
+public:
+    using layout = Layout;
+    using snapshot_type = hdr_snapshot<Layout>;
+
+    /* Negative values (a clock stepped back) count as 0, values above max_value as max_value */
+    void record(int64_t ns) {
+        counts[Layout::index(uint64_t(std::max<int64_t>(ns, 0)))].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    snapshot_type snapshot() const {
+        snapshot_type s;
+        for (size_t i = 0; i < counts.size(); ++i)
+            s.counts[i] = counts[i].load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, Layout::buckets> counts = {};
+};
@@ -0,0 +1,1495 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+
+#include "buf_return_lane.hpp"
+#include "net.hpp"
+#include "numa_mem.hpp"
+#include "timer_wheel.hpp"
+#include "uring_coro.hpp"
+#include "uring_ops.hpp"
+#include "zc_sender.hpp"
+
+struct printf_debug_handler {
+    template <typename... Args>
+    void operator()(auto&&... args) const {
+        fprintf(stderr, args...);
+    }
+    constexpr operator bool() const noexcept {
+        return true;
+    }
+};
+
+struct ring_metrics {
+    uint64_t sends_completed = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t send_errors = 0;
+    /* send_to() and send_snapshot() calls refused because every send slot was in flight */
+    uint64_t sends_rejected = 0;
+    /* Snapshots shorter than zc_copy_threshold sent through the copying path */
+    uint64_t snapshot_copies = 0;
+    /* Datagrams appended to an already queued sendmsg as an extra UDP GSO segment */
+    uint64_t gso_segments_packed = 0;
+    /* io_uring_enter() calls made by run_once() and by a full SQ */
+    uint64_t submits = 0;
+    /* io_uring_enter() calls which woke up the idle SQ polling thread */
+    uint64_t sq_wakeups = 0;
+    /* Receive CQEs carrying a UDP GRO super-packet and the datagrams they were split into */
+    uint64_t gro_packets = 0;
+    uint64_t gro_segments = 0;
+    /* Bytes of provided buffers taken by received messages and the payload bytes delivered from them */
+    uint64_t recv_buffer_bytes = 0;
+    uint64_t recv_payload_bytes = 0;
+    /* Datagrams dropped because they did not fit into a whole provided buffer */
+    uint64_t recv_truncated = 0;
+    /* Datagrams dropped by incremental buffers because they did not fit into the tail left in the current buffer,
+     * though a whole buffer would have held them. The kernel has consumed them, they cannot be read again */
+    uint64_t recv_truncated_tail = 0;
+    /* CQE batches handed to the receive handler as one recv_batch and the datagrams dropped because every recv_batch
+     * was still held by the consumers */
+    uint64_t recv_batches = 0;
+    uint64_t recv_batch_drops = 0;
+    /* Buffers given back to the buffer rings and the batches (one tail update per group) they were given back in */
+    uint64_t buf_returned = 0;
+    uint64_t buf_return_batches = 0;
+    /* Multishot recvmsg requests queued and the ones ended by the kernel: out of provided buffers, with an error
+     * or for another reason (e.g. CQ overflow) */
+    uint64_t recv_arms = 0;
+    uint64_t recv_ended_nobufs = 0;
+    uint64_t recv_ended_error = 0;
+    uint64_t recv_ended_other = 0;
+    /* Sockets left without a receive after an error which re-arming would only repeat (e.g. -EINVAL, -ENOTSOCK) */
+    uint64_t recv_failed = 0;
+    /* Ticks run, ticks which ended after the next deadline had passed (late start or slow handler) and the
+     * deadlines skipped to get back in phase */
+    uint64_t ticks = 0;
+    uint64_t tick_overruns = 0;
+    uint64_t ticks_skipped = 0;
+    /* How late ticks started after their deadline. Bucket i of the histogram counts ticks less than 2^i us late,
+     * the last bucket all later ones */
+    uint64_t tick_jitter_sum_ns = 0;
+    uint64_t tick_jitter_max_ns = 0;
+    uint64_t tick_jitter_hist[16] = {};
+    /* uring_task coroutines resumed from the CQE loop */
+    uint64_t coro_resumes = 0;
+
+    /* Share of the taken buffer memory which holds payload */
+    double buffer_utilization() const {
+        return recv_buffer_bytes ? double(recv_payload_bytes) / double(recv_buffer_bytes) : 0.0;
+    }
+};
+
+struct buf_class {
+    uint32_t size = 0;
+    /* Power of two, zero marks an unused class */
+    uint32_t count = 0;
+};
+
+inline constexpr size_t max_buf_classes = 4;
+
+/* Tells rings apart in the per-thread return lane cache */
+inline std::atomic<uint64_t> ring_ids = 0;
+
+struct uring_settings {
+    uint32_t sq_depth = 32;
+    uint32_t cq_multiplier = 8;
+    uint32_t batch_size_multiplier = 2;
+    uint32_t buf_size = 4096;
+    /* Provided buffer size classes, each one is registered as its own buffer group (bgid == class index) and a socket
+     * receives into the group chosen by set_recv_group(). No classes: one group of batch_size buffers of buf_size */
+    std::array<buf_class, max_buf_classes> buf_classes = {};
+    /* Register buffer groups with IOU_PBUF_RING_INC (kernel 6.12+): a message takes only the bytes it needs from
+     * a buffer and the rest stays in the ring for the next messages, so small datagrams share one large buffer.
+     * A datagram longer than the tail left in a buffer is truncated and lost, counted in recv_truncated_tail: about
+     * one datagram per buffer is lost this way, so the buffers should be much larger than the expected datagrams */
+    bool buf_incremental = false;
+    /* Pages backing the buffer rings: huge pages cut the TLB misses of large rings. Falls back to regular pages */
+    mem_backing buf_backing = mem_backing::regular;
+    /* Place the buffer rings on the NUMA node of the CPU which constructs the context (the pinned shard thread) */
+    bool buf_numa_local = false;
+    /* Size of the fixed file table, sockets are registered with register_files() */
+    uint32_t max_files = 8;
+    /* Hand the datagrams of every CQE batch to the receive handler at once as a recv_batch (struct of arrays)
+     * instead of one call per datagram. Number of batches the consumers may hold at a time, zero disables */
+    uint32_t recv_batches = 0;
+    /* Lock-free queues carrying buffers dropped by other threads back to the ring thread. Every thread gets its own
+     * lane until they run out, then lanes are shared */
+    uint32_t buf_return_lanes = 4;
+    /* How long run_once() waits for completions while a socket waits for returned buffers to re-arm its receive */
+    uint32_t recv_retry_us = 1000;
+    /* Submit through a kernel SQ polling thread: run_once() enters the kernel only to wake up the thread after
+     * sqpoll_idle_ms without submissions or to sleep when no CQE is ready */
+    bool sqpoll = false;
+    uint32_t sqpoll_idle_ms = 1000;
+    /* CPU the SQ polling thread is pinned to, -1 leaves it to the scheduler */
+    int32_t sqpoll_cpu = -1;
+    /* The ring is driven only by the thread which created it (IORING_SETUP_SINGLE_ISSUER, kernel 6.0+) */
+    bool single_issuer = false;
+    /* Run completion task work only when run_once() enters the kernel to get events instead of interrupting the
+     * ring thread whenever a request completes (IORING_SETUP_DEFER_TASKRUN, kernel 6.1+, needs single_issuer) */
+    bool defer_taskrun = false;
+    /* Register the ring fd so io_uring_enter() skips the fd table lookup (kernel 5.18+) */
+    bool register_ring_fd = false;
+    /* Print receive and buffer usage stats through the debug handler every N receive CQEs, zero disables */
+    uint32_t stats_interval = 0;
+    /* Max in-flight sendmsg requests and the size of the copy buffer owned by each of them */
+    uint32_t send_depth = 64;
+    uint32_t send_buf_size = 2048;
+    /* Registered snapshot buffers for SEND_ZC, zero disables the zero-copy sender */
+    uint32_t zc_buffers = 0;
+    uint32_t zc_buf_size = 16384;
+    uint32_t zc_send_depth = 256;
+    /* Snapshots shorter than this are copied: pinning pages and the extra notification CQE cost more than memcpy */
+    uint32_t zc_copy_threshold = 1024;
+    /* Pack consecutive send_to() datagrams for the same destination into one UDP_SEGMENT super-buffer.
+     * send_buf_size bounds the super-buffer, so it should be raised to fit several segments */
+    bool udp_gso = false;
+    /* Expect UDP GRO super-packets (the socket needs sock_options::udp_gro) and split them back into datagrams.
+     * A super-packet takes up to 64KB, so buf_size must be raised accordingly */
+    bool udp_gro = false;
+    /* Read the kernel receive timestamp of every datagram (the socket needs sock_options::rx_timestamps) into
+     * buf_scope::rx_ns / recv_batch::rx_ns, together with the time the ring thread took its CQE batch */
+    bool recv_timestamps = false;
+};
+
+struct no_zc_sender {};
+
+template <auto V>
+struct type_c {};
+
+/* RH receives the datagrams, DH prints debug messages, OH is an op_table with the handlers of user-defined ops */
+template <uring_settings settings, typename RH, typename DH = printf_debug_handler, typename OH = op_table<>>
+class io_uring_ctx {
+public:
+    static constexpr auto sq_depth = settings.sq_depth;
+    static constexpr auto cq_depth = sq_depth * settings.cq_multiplier;
+    static constexpr auto batch_size = cq_depth * settings.batch_size_multiplier;
+    static constexpr auto buf_size = settings.buf_size;
+    static constexpr auto max_files = settings.max_files;
+
+    static constexpr uint32_t setup_flags = [] {
+        uint32_t flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+        if (settings.sqpoll)
+            flags |= IORING_SETUP_SQPOLL;
+        if (settings.sqpoll && settings.sqpoll_cpu >= 0)
+            flags |= IORING_SETUP_SQ_AFF;
+        if (settings.single_issuer)
+            flags |= IORING_SETUP_SINGLE_ISSUER;
+        /* IORING_SQ_TASKRUN tells liburing that deferred work is pending, so run_once(0) enters to run it */
+        if (settings.defer_taskrun)
+            flags |= IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+        return flags;
+    }();
+
+    static constexpr auto buf_classes = [] {
+        std::array<buf_class, max_buf_classes> classes = {};
+        size_t                                 count = 0;
+        for (auto c : settings.buf_classes)
+            if (c.count != 0)
+                classes[count++] = c;
+        if (count == 0)
+            classes[0] = {.size = buf_size, .count = batch_size};
+        return classes;
+    }();
+
+    static constexpr size_t buf_groups = [] {
+        size_t count = 0;
+        while (count < max_buf_classes && buf_classes[count].count != 0)
+            ++count;
+        return count;
+    }();
+
+    /* Index of the first buffer of each group in the per-buffer arrays */
+    static constexpr auto buf_first = [] {
+        std::array<uint32_t, max_buf_classes + 1> first = {};
+        for (size_t g = 0; g < buf_groups; ++g)
+            first[g + 1] = first[g] + buf_classes[g].count;
+        return first;
+    }();
+
+    static constexpr uint32_t total_buffers = buf_first[buf_groups];
+
+    static constexpr bool batch_handoff = settings.recv_batches > 0;
+
+    /* A lane can hold every buffer, so a push never finds it full */
+    using return_lane = buf_return_lane<std::bit_ceil(total_buffers)>;
+    static constexpr auto return_lanes = settings.buf_return_lanes;
+    /* Rings a thread remembers its return lane for */
+    static constexpr size_t lane_cache_size = 64;
+
+    /* Provisioned memory of every buffer group */
+    static constexpr size_t buffer_memory = [] {
+        size_t size = 0;
+        for (size_t g = 0; g < buf_groups; ++g)
+            size += size_t(buf_classes[g].size) * buf_classes[g].count;
+        return size;
+    }();
+
+    static constexpr size_t buf_ring_size(size_t group) {
+        return (sizeof(io_uring_buf) + buf_classes[group].size) * buf_classes[group].count;
+    }
+    static constexpr auto send_depth = settings.send_depth;
+    static constexpr auto send_buf_size = settings.send_buf_size;
+
+    static constexpr bool zc_enabled = settings.zc_buffers > 0;
+
+    /* UDP_MAX_SEGMENTS of older kernels */
+    static constexpr uint32_t gso_max_segments = 64;
+    /* Control area of received messages */
+    static constexpr size_t recv_control_size = (settings.udp_gro ? CMSG_SPACE(sizeof(int)) : 0) +
+                                                (settings.recv_timestamps ? CMSG_SPACE(sizeof(timespec)) : 0);
+    /* Several buf_scopes may point into one provided buffer, it is recycled when the last of them is dropped */
+    static constexpr bool shared_buffers = settings.udp_gro || settings.buf_incremental;
+
+    static_assert(send_depth > 0 && send_depth <= UINT16_MAX, "send_depth must fit into uint16_t");
+    static_assert(max_files > 0 && max_files <= UINT16_MAX, "a fixed file index must fit into user_data");
+    static_assert(return_lanes > 0, "at least one buffer return lane is needed");
+    static_assert(!settings.defer_taskrun || settings.single_issuer, "defer_taskrun needs single_issuer");
+    static_assert(!settings.defer_taskrun || !settings.sqpoll, "with sqpoll the task work runs in the SQ thread");
+    static_assert(
+        [] {
+            for (size_t g = 0; g < buf_groups; ++g)
+                if ((buf_classes[g].count & (buf_classes[g].count - 1)) != 0 || buf_classes[g].count > 32768)
+                    return false;
+            return true;
+        }(),
+        "buffer group sizes must be powers of two not greater than 32768");
+    static_assert(!settings.udp_gro ||
+                      [] {
+                          for (size_t g = 0; g < buf_groups; ++g)
+                              if (buf_classes[g].size < 65536)
+                                  return false;
+                          return true;
+                      }(),
+                  "a GRO super-packet does not fit into a provided buffer");
+    static_assert(send_buf_size <= 65507, "a send slot holds at most the max UDP payload (GSO super-buffer included)");
+    static_assert(!zc_enabled || settings.zc_copy_threshold <= send_buf_size,
+                  "snapshots below zc_copy_threshold must fit into a send slot");
+
+private:
+    struct buf_scope;
+    class batch_ref;
+
+public:
+    using buffer_type = buf_scope;
+    using batch_type = batch_ref;
+
+    /* Datagrams of one CQE batch in struct-of-arrays layout: datagram i is len[i] bytes at data[i] received from src[i]
+     * through fixed file file[i], it lives in buffer buf_id[i] of buffer group group[i]. With recv_timestamps the
+     * kernel received it at rx_ns[i] (0 if the socket sent no timestamp) and the ring took the CQEs at cqe_ns */
+    struct recv_batch {
+        static constexpr uint32_t capacity = cq_depth;
+
+        uint32_t       count = 0;
+        int64_t        cqe_ns = 0;
+        int64_t        rx_ns[capacity];
+        sockaddr_in    src[capacity];
+        const uint8_t* data[capacity];
+        uint32_t       len[capacity];
+        uint16_t       file[capacity];
+        uint16_t       group[capacity];
+        uint16_t       buf_id[capacity];
+    };
+
+    io_uring_ctx(type_c<settings>,
+                 RH receive_handler,
+                 DH debug_handler = printf_debug_handler{},
+                 OH op_handlers = op_table<>{}):
+        receive_h(std::move(receive_handler)), debug(std::move(debug_handler)), user_ops(std::move(op_handlers)) {
+        setup();
+    }
+
+    io_uring_ctx(const io_uring_ctx&) = delete;
+    io_uring_ctx& operator=(const io_uring_ctx&) = delete;
+
+    ~io_uring_ctx() {
+        io_uring_queue_exit(&ring);
+        unmap_send_slots();
+        unmap_buffers();
+    }
+
+    /* Registers the sockets as fixed files 0..count-1, run() listens on all of them */
+    int register_files(int* fds, unsigned int count) {
+        if (count > max_files) {
+            debug("register file failed: %u files, max_files is %u\n", count, max_files);
+            return -EINVAL;
+        }
+
+        int rc = io_uring_register_files(&ring, fds, count);
+        if (rc)
+            debug("register file failed: %s\n", strerror(-rc));
+        else
+            files_count = count;
+        return rc;
+    }
+
+    /* Selects the buffer group (size class) the socket at fixed file index fdidx receives into */
+    void set_recv_group(int fdidx, uint16_t group) {
+        if (size_t(fdidx) >= max_files || group >= buf_groups) {
+            debug("bad recv group %u for file %d\n", group, fdidx);
+            return;
+        }
+        recv_groups[fdidx] = group;
+    }
+
+    /* Arms a multishot recvmsg on the socket at fixed file index idx unless one is already in flight. The request
+     * stays armed until the kernel ends it, then process_cqe_recv() queues the next one */
+    void add_recv_request(int idx) {
+        if (recv_state[idx] == recv_armed)
+            return;
+
+        auto group = recv_groups[idx];
+
+        io_uring_sqe* sqe = next_sqe();
+        if (!sqe) {
+            set_recv_state(idx, recv_pending);
+            return;
+        }
+        set_recv_state(idx, recv_armed);
+        ++metrics.recv_arms;
+
+        io_uring_prep_recvmsg_multishot(sqe, idx, &msg, MSG_TRUNC);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+        sqe->user_data = op_data<sqe_op_recvmsg>{.fdidx = uint16_t(idx), .tag = group}.encode();
+    }
+
+    /* Queues a copy of the datagram to the socket registered at fixed file index fdidx. The SQE goes to the kernel
+     * with the next io_uring_submit_and_wait() in run(), together with the receive re-arm, so a reply queued from the
+     * receive handler costs no extra syscall.
+     * With udp_gso the datagram is appended as one more segment to the previous not yet submitted send if it goes to
+     * the same destination and is not longer than the segments already there.
+     * Returns 0, -EMSGSIZE if len does not fit into a send slot or -EAGAIN if every send slot is in flight */
+    int send_to(int fdidx, const sockaddr_in& dst, const void* data, size_t len) {
+        if (len > send_buf_size)
+            return -EMSGSIZE;
+
+        if constexpr (settings.udp_gso) {
+            if (gso_available && gso_append(fdidx, dst, data, len))
+                return 0;
+        }
+
+        if (free_send_count == 0) {
+            ++metrics.sends_rejected;
+            return -EAGAIN;
+        }
+
+        io_uring_sqe* sqe = next_sqe();
+        if (!sqe)
+            return -EBUSY;
+
+        auto  slot_idx = free_send_slots[--free_send_count];
+        auto& slot = send_slots[slot_idx];
+        auto  buf = send_buffer(slot_idx);
+        memcpy(buf, data, len);
+
+        slot.dst = dst;
+        slot.iov = {.iov_base = buf, .iov_len = len};
+        slot.msg = {
+            .msg_name    = &slot.dst,
+            .msg_namelen = sizeof(slot.dst),
+            .msg_iov     = &slot.iov,
+            .msg_iovlen  = 1,
+        };
+        slot.fdidx = fdidx;
+        slot.segment_size = uint16_t(len);
+        slot.segments = 1;
+        gso_tail = slot_idx;
+
+        io_uring_prep_sendmsg(sqe, fdidx, &slot.msg, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->user_data = op_data<sqe_op_sendmsg>{.fdidx = uint16_t(fdidx), .tag = slot_idx}.encode();
+        return 0;
+    }
+
+    size_t sends_in_flight() const {
+        return send_depth - free_send_count;
+    }
+
+    /* True if send_to() packs datagrams with UDP GSO: enabled in settings and supported by the kernel */
+    bool gso_active() const {
+        return settings.udp_gso && gso_available;
+    }
+
+    /* Returns a snapshot id to fill through snapshot_data() or -EAGAIN if every snapshot buffer is in use */
+    int acquire_snapshot()
+        requires zc_enabled
+    {
+        return zc.acquire();
+    }
+
+    uint8_t* snapshot_data(uint16_t id)
+        requires zc_enabled
+    {
+        return zc.buffer(id);
+    }
+
+    /* Queues a send of the first len bytes of snapshot id. The buffer is sent in place with SEND_ZC unless len is below
+     * zc_copy_threshold. Returns 0, -EMSGSIZE, -EAGAIN if every send slot is in flight or -EBUSY if the SQ is full */
+    int send_snapshot(int fdidx, uint16_t id, size_t len, const sockaddr_in& dst)
+        requires zc_enabled
+    {
+        if (len < settings.zc_copy_threshold) {
+            ++metrics.snapshot_copies;
+            return send_to(fdidx, dst, zc.buffer(id), len);
+        }
+
+        if (len > zc.buf_size)
+            return -EMSGSIZE;
+
+        if (!zc.can_send()) {
+            ++metrics.sends_rejected;
+            return -EAGAIN;
+        }
+
+        io_uring_sqe* sqe = next_sqe();
+        if (!sqe)
+            return -EBUSY;
+
+        zc.send(sqe, fdidx, id, len, dst);
+        return 0;
+    }
+
+    /* Queues the snapshot to every destination, returns the number of sends queued */
+    size_t broadcast_snapshot(int fdidx, uint16_t id, size_t len, std::span<const sockaddr_in> dsts)
+        requires zc_enabled
+    {
+        size_t queued = 0;
+        for (auto& dst : dsts) {
+            if (send_snapshot(fdidx, id, len, dst) != 0)
+                break;
+            ++queued;
+        }
+        return queued;
+    }
+
+    /* Gives up the owner reference, the buffer is reused once every queued send of it is notified */
+    void release_snapshot(uint16_t id)
+        requires zc_enabled
+    {
+        zc.release(id);
+    }
+
+    /* SQE for a user-defined op: the caller tags it with op_data<op>{...}.encode() and the CQE goes to the handler of
+     * the op in OH. nullptr if the SQ is still full after a submit */
+    io_uring_sqe* get_sqe() {
+        return next_sqe();
+    }
+
+    struct tick_info {
+        uint64_t tick;
+        int64_t  deadline_ns;
+        /* Start of the handler after the deadline */
+        int64_t  late_ns;
+    };
+
+    /*
+     * Calls f(const tick_info&) from run_once() every period, on the CLOCK_MONOTONIC deadlines now + n * period.
+     * The deadline is an absolute IORING_OP_TIMEOUT in the ring, so the ring thread sleeps until the next packet or
+     * the next tick, whichever comes first, and ticks do not drift. A tick ending after the next deadline skips the
+     * deadlines already passed instead of running them back to back. Restarting replaces the previous ticks
+     */
+    template <typename F>
+    void start_ticks(std::chrono::nanoseconds period, F&& f) {
+        tick_h = std::forward<F>(f);
+        tick_period = std::max<int64_t>(period.count(), 1);
+        tick_deadline = monotonic_ns() + tick_period;
+        ++tick_generation;
+        arm_tick();
+    }
+
+    /* The timeout in flight still completes, its CQE is ignored */
+    void stop_ticks() {
+        tick_period = 0;
+        ++tick_generation;
+    }
+
+    /* Per-session timers (idle disconnect, resend, keepalive) in tick periods: the wheel is advanced by every tick
+     * period, skipped ones included, before the tick handler runs. Timers fire only while ticks run and need no SQE
+     * of their own */
+    timer_wheel& timers() {
+        return wheel;
+    }
+
+    /*
+     * Awaitables for uring_task coroutines, e.g. auto [len, src] = co_await ctx.recv_from(fdidx, buf). Each queues one
+     * SQE tagged with the coroutine handle, run_once() resumes the coroutine inline when its CQE arrives. Results are
+     * those of the CQE: bytes or -errno, -EBUSY if the SQ stayed full
+     */
+    recv_awaitable<io_uring_ctx> recv_from(int fdidx, std::span<uint8_t> buf) {
+        return {*this, fdidx, buf};
+    }
+
+    send_awaitable<io_uring_ctx> send_datagram(int fdidx, const sockaddr_in& dst, std::span<const uint8_t> data) {
+        return {*this, fdidx, dst, data};
+    }
+
+    timeout_awaitable<io_uring_ctx> sleep_for(std::chrono::nanoseconds duration) {
+        return {*this, duration};
+    }
+
+    write_awaitable<io_uring_ctx> write_file(int fd, std::span<const uint8_t> data, uint64_t offset) {
+        return {*this, fd, data, offset};
+    }
+
+    const ring_metrics& stats() const {
+        return metrics;
+    }
+
+    const zc_metrics& zc_stats() const
+        requires zc_enabled
+    {
+        return zc.stats();
+    }
+
+    /* Arms the receive of every registered socket. run() does it itself, a caller driving run_once() on its own (the
+     * fiber scheduler) has to call it once after register_files() */
+    void arm_receives() {
+        for (unsigned idx = 0; idx < files_count; ++idx)
+            add_recv_request(int(idx));
+    }
+
+    void run() {
+        arm_receives();
+        while (run_once() >= 0)
+            ;
+    }
+
+    /* Submits every queued SQE, waits for at least wait_nr completions and processes a batch of CQEs.
+     * Returns the number of processed CQEs or a negative error of io_uring_submit_and_wait() */
+    int run_once(unsigned wait_nr = 1) {
+        flush_returns();
+        if (recv_pending_count)
+            rearm_pending();
+        if (tick_arm_pending)
+            arm_tick();
+
+        /* A socket still waiting for buffers is retried after recv_retry_us even if nothing else completes */
+        __kernel_timespec retry = {.tv_sec = 0, .tv_nsec = int64_t(settings.recv_retry_us) * 1000};
+        auto rc = submit_and_wait(wait_nr, recv_pending_count && wait_nr ? &retry : nullptr);
+        if (rc == -EINTR) {
+            fprintf(stderr, "EINTR\n");
+            return 0;
+        }
+
+        if (rc < 0) {
+            debug("io_uring_submit_and_wait() failed: %d\n", rc);
+            return rc;
+        }
+
+        auto count = io_uring_peek_batch_cqe(&ring, cqes, cq_depth /* batch_size */);
+        /* One clock read per batch, in the clock of SO_TIMESTAMPNS */
+        if constexpr (settings.recv_timestamps) {
+            if (count) {
+                timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                cqe_now_ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
+            }
+        }
+        //fprintf(stderr, "batch: %zu\n", count);
+        for (size_t i = 0; i < count; ++i)
+            process_cqe(cqes[i]);
+        if constexpr (batch_handoff)
+            hand_off_batch();
+
+        //buf_ring_advance(int(count));
+        io_uring_cq_advance(&ring, count);
+        return int(count);
+    }
+
+    /* Longest datagram a buffer of the group holds together with the recvmsg header, the source address and the
+     * control messages. Longer datagrams are truncated by the kernel and dropped, counted in recv_truncated */
+    static constexpr size_t max_datagram(size_t group) {
+        return buf_classes[group].size - sizeof(io_uring_recvmsg_out) - sizeof(sockaddr_in) - recv_control_size;
+    }
+
+    uint8_t* buffer(size_t group, size_t idx) {
+        auto& c = buf_classes[group];
+        return ((uint8_t*)buf_rings[group] + sizeof(io_uring_buf) * c.count) + idx * c.size;
+    }
+
+private:
+    void setup() {
+        io_uring_params params = {
+            .cq_entries = cq_depth,
+            .flags = setup_flags,
+            .sq_thread_cpu = settings.sqpoll_cpu >= 0 ? uint32_t(settings.sqpoll_cpu) : 0,
+            .sq_thread_idle = settings.sqpoll_idle_ms,
+        };
+        auto rc = io_uring_queue_init_params(sq_depth, &ring, &params);
+        if (rc < 0)
+            throw std::runtime_error("queue_init failed: " + std::string(strerror(-rc)));
+
+        if constexpr (settings.register_ring_fd) {
+            /* An optimization only: io_uring_enter() falls back to the regular fd */
+            rc = io_uring_register_ring_fd(&ring);
+            if (rc < 0)
+                debug("ring fd registration failed: %s\n", strerror(-rc));
+        }
+
+        try {
+            setup_buffer();
+            setup_send_slots();
+            if constexpr (batch_handoff)
+                setup_batches();
+            if constexpr (settings.udp_gso) {
+                gso_available = udp_gso_supported();
+                if (!gso_available)
+                    debug("UDP GSO is not supported, sending one datagram per SQE\n");
+            }
+            if constexpr (zc_enabled)
+                zc.setup(&ring);
+        }
+        catch (...) {
+            io_uring_queue_exit(&ring);
+            unmap_send_slots();
+            unmap_buffers();
+            throw;
+        }
+    }
+
+    void setup_send_slots() {
+        send_bufs = (uint8_t*)mmap(
+            nullptr, send_depth * send_buf_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+        if (send_bufs == MAP_FAILED) {
+            send_bufs = nullptr;
+            throw std::runtime_error("send buffers mmap failed: " + std::string(strerror(errno)));
+        }
+
+        for (uint32_t i = 0; i < send_depth; ++i)
+            free_send_slots[i] = uint16_t(send_depth - 1 - i);
+        free_send_count = send_depth;
+    }
+
+    void unmap_send_slots() {
+        if (send_bufs)
+            munmap(send_bufs, send_depth * send_buf_size);
+        send_bufs = nullptr;
+    }
+
+    void setup_batches() {
+        for (uint32_t i = 0; i < batches_count; ++i)
+            free_batches[i] = batches_count - 1 - i;
+        free_batch_count = batches_count;
+    }
+
+    uint8_t* send_buffer(size_t idx) {
+        return send_bufs + idx * send_buf_size;
+    }
+
+    void setup_buffer() {
+        for (uint16_t g = 0; g < buf_groups; ++g)
+            setup_buffer_group(g);
+    }
+
+    void setup_buffer_group(uint16_t group) {
+        auto count = buf_classes[group].count;
+
+        auto node = settings.buf_numa_local ? current_numa_node() : -1;
+        auto& mem = buf_mem[group] = map_memory(buf_ring_size(group), settings.buf_backing, node);
+        if (!mem.addr)
+            throw std::runtime_error("buffer ring mmap failed: " + std::string(strerror(errno)));
+        buf_rings[group] = (io_uring_buf_ring*)mem.addr;
+
+        if (mem.backing != settings.buf_backing)
+            debug("buffer group %u: %s pages are not available, using %s pages\n",
+                  group,
+                  mem_backing_name(settings.buf_backing),
+                  mem_backing_name(mem.backing));
+        if (mem.numa_node != node)
+            debug("buffer group %u: cannot bind to NUMA node %d\n", group, node);
+
+        io_uring_buf_ring_init(buf_rings[group]);
+
+        io_uring_buf_reg reg = {
+            .ring_addr = (uint64_t)buf_rings[group],
+            .ring_entries = count,
+            .bgid = group,
+            .flags = settings.buf_incremental ? uint16_t(IOU_PBUF_RING_INC) : uint16_t(0),
+        };
+
+        auto rc = io_uring_register_buf_ring(&ring, &reg, 0);
+        if (rc)
+            throw std::runtime_error("buffer ring init failed: " + std::string(strerror(-rc)) +
+                                     (settings.buf_incremental ? " (incremental buffers need kernel 6.12+)" : ""));
+
+        for (uint32_t i = 0; i < count; ++i)
+            io_uring_buf_ring_add(buf_rings[group],
+                                  buffer(group, i),
+                                  buf_classes[group].size,
+                                  uint16_t(i),
+                                  io_uring_buf_ring_mask(count),
+                                  int(i));
+
+        buf_ring_advance(group, int(count));
+    }
+
+    void unmap_buffers() {
+        for (size_t g = 0; g < buf_groups; ++g)
+            unmap_memory(buf_mem[g]);
+    }
+
+    void buf_ring_recycle(size_t group, size_t idx, int offset) {
+        io_uring_buf_ring_add(buf_rings[group],
+                              buffer(group, idx),
+                              buf_classes[group].size,
+                              uint16_t(idx),
+                              io_uring_buf_ring_mask(buf_classes[group].count),
+                              offset);
+    }
+
+    /* Only the ring thread moves the tail */
+    void buf_ring_advance(size_t group, int count) {
+        io_uring_buf_ring_advance(buf_rings[group], count);
+        buf_available[group] += uint32_t(count);
+    }
+
+    /* Drops a reference to the buffer, the last one gives it back. May be called from any thread */
+    void buf_release(size_t group, size_t idx) {
+        if constexpr (shared_buffers) {
+            if (buf_refs[buf_first[group] + idx].fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+        }
+        return_buffer(group, idx);
+    }
+
+    struct lane_claim {
+        uint64_t ring = 0;
+        uint32_t lane = 0;
+    };
+
+    /* The ring thread collects its own buffers in a plain array, other threads push them to their return lane.
+     * Either way the buffer goes back to the ring with the next flush_returns() */
+    void return_buffer(size_t group, size_t idx) {
+        auto id = uint32_t(group << 16 | idx);
+        if (std::this_thread::get_id() == ring_thread) {
+            local_returns[local_returns_count++] = id;
+            return;
+        }
+
+        /* Ring ids are dense, so a thread serving several rings keeps a lane of each of them unless the process has
+         * more than lane_cache_size rings */
+        thread_local lane_claim claims[lane_cache_size];
+        auto& claim = claims[ring_id % lane_cache_size];
+        if (claim.ring != ring_id) {
+            claim.ring = ring_id;
+            claim.lane = next_lane.fetch_add(1, std::memory_order_relaxed) % return_lanes;
+        }
+        while (!lanes[claim.lane].push(id))
+            std::this_thread::yield();
+    }
+
+    /* Adds every returned buffer to its ring with one tail update per group */
+    void flush_returns() {
+        int  added[buf_groups] = {};
+        auto add = [&](uint32_t id) {
+            auto group = id >> 16;
+            buf_ring_recycle(group, id & 0xffff, added[group]++);
+        };
+
+        for (uint32_t i = 0; i < local_returns_count; ++i)
+            add(local_returns[i]);
+        local_returns_count = 0;
+
+        for (uint32_t lane = 0; lane < return_lanes; ++lane)
+            lanes[lane].drain(add);
+
+        for (size_t g = 0; g < buf_groups; ++g) {
+            if (added[g] == 0)
+                continue;
+            buf_ring_advance(g, added[g]);
+            metrics.buf_returned += uint64_t(added[g]);
+            ++metrics.buf_return_batches;
+        }
+    }
+
+    /* Returns -ETIME as 0: the caller processes whatever has completed */
+    int submit_and_wait(unsigned wait_nr, __kernel_timespec* timeout = nullptr) {
+        io_uring_cqe* cqe;
+        if constexpr (!settings.sqpoll) {
+            auto rc = timeout ? io_uring_submit_and_wait_timeout(&ring, &cqe, wait_nr, timeout, nullptr)
+                              : io_uring_submit_and_wait(&ring, wait_nr);
+            on_submit();
+            return rc == -ETIME ? 0 : rc;
+        }
+        else {
+            /* The SQ thread picks up the new SQEs by itself: io_uring_submit() only publishes the SQ tail and enters
+             * the kernel if the thread has gone idle (IORING_SQ_NEED_WAKEUP) or the CQ has overflowed */
+            bool wakeup = IO_URING_READ_ONCE(*ring.sq.kflags) & IORING_SQ_NEED_WAKEUP;
+            auto rc = io_uring_submit(&ring);
+            on_submit(wakeup);
+            if (wakeup)
+                ++metrics.sq_wakeups;
+
+            if (rc < 0 || io_uring_cq_ready(&ring) >= wait_nr)
+                return rc;
+
+            ++metrics.submits;
+            rc = timeout ? io_uring_wait_cqes(&ring, &cqe, wait_nr, timeout, nullptr)
+                         : io_uring_wait_cqe_nr(&ring, &cqe, wait_nr);
+            return rc == -ETIME ? 0 : rc;
+        }
+    }
+
+    /* Submitted sendmsg headers are owned by the kernel, so GSO packing starts over from the next send */
+    void on_submit(bool entered = true) {
+        if (entered)
+            ++metrics.submits;
+        gso_tail = no_send_slot;
+    }
+
+    bool gso_append(int fdidx, const sockaddr_in& dst, const void* data, size_t len) {
+        if (gso_tail == no_send_slot)
+            return false;
+
+        auto& slot = send_slots[gso_tail];
+        if (slot.fdidx != fdidx || slot.dst.sin_addr.s_addr != dst.sin_addr.s_addr ||
+            slot.dst.sin_port != dst.sin_port)
+            return false;
+
+        /* Every segment but the last one must be exactly segment_size long */
+        if (len > slot.segment_size || slot.segments == gso_max_segments || slot.iov.iov_len + len > send_buf_size)
+            return false;
+
+        memcpy((uint8_t*)slot.iov.iov_base + slot.iov.iov_len, data, len);
+        slot.iov.iov_len += len;
+        ++slot.segments;
+        ++metrics.gso_segments_packed;
+
+        if (slot.segments == 2) {
+            slot.msg.msg_control = slot.control;
+            slot.msg.msg_controllen = sizeof(slot.control);
+
+            auto cmsg = CMSG_FIRSTHDR(&slot.msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &slot.segment_size, sizeof(uint16_t));
+        }
+
+        /* A short segment terminates the super-buffer */
+        if (len < slot.segment_size)
+            gso_tail = no_send_slot;
+
+        return true;
+    }
+
+    io_uring_sqe* next_sqe() {
+        if (auto sqe = io_uring_get_sqe(&ring))
+            return sqe;
+
+        debug("cannot get SQE: SQ is full, trying submit it to get next SQE...\n");
+        io_uring_submit(&ring);
+        on_submit();
+        /* The SQ polling thread frees the entries asynchronously */
+        if constexpr (settings.sqpoll)
+            io_uring_sqring_wait(&ring);
+
+        if (auto sqe = io_uring_get_sqe(&ring))
+            return sqe;
+
+        debug("cannot get SQE\n");
+        return nullptr;
+    }
+
+    /* Owning handle of a recv_batch: dropping it gives the buffers and the batch back, from any thread */
+    class batch_ref {
+    public:
+        batch_ref() = default;
+        batch_ref(io_uring_ctx* ictx, uint32_t iidx): ctx(ictx), idx(iidx) {}
+
+        batch_ref(batch_ref&& b) noexcept: ctx(b.ctx), idx(b.idx) {
+            b.ctx = nullptr;
+        }
+
+        batch_ref& operator=(batch_ref&& b) noexcept {
+            std::swap(ctx, b.ctx);
+            std::swap(idx, b.idx);
+            return *this;
+        }
+
+        ~batch_ref() {
+            if (ctx)
+                ctx->release_batch(idx);
+        }
+
+        const recv_batch& operator*() const {
+            return ctx->batches[idx];
+        }
+
+        const recv_batch* operator->() const {
+            return &ctx->batches[idx];
+        }
+
+    private:
+        io_uring_ctx* ctx = nullptr;
+        uint32_t      idx = 0;
+    };
+
+    struct buf_scope {
+        buf_scope(): ctx(nullptr) {}
+
+        buf_scope(uint8_t* ipayload, size_t ilen, uint16_t igroup, size_t iidx, io_uring_ctx* ictx):
+            payload(ipayload), len(ilen), group(igroup), idx(iidx), ctx(ictx) {}
+
+        buf_scope(buf_scope&& bs) noexcept:
+            payload(bs.payload), len(bs.len), group(bs.group), idx(bs.idx), ctx(bs.ctx), rx_ns(bs.rx_ns),
+            cqe_ns(bs.cqe_ns) {
+            bs.ctx = nullptr;
+        }
+
+        buf_scope& operator=(buf_scope&& bs) noexcept {
+            if (&bs == this)
+                return *this;
+
+            payload = bs.payload;
+            len = bs.len;
+            group = bs.group;
+            idx = bs.idx;
+            ctx = bs.ctx;
+            rx_ns = bs.rx_ns;
+            cqe_ns = bs.cqe_ns;
+            bs.ctx = nullptr;
+            return *this;
+        }
+
+        ~buf_scope() {
+            if (ctx)
+                ctx->buf_release(group, idx);
+        }
+
+        const uint8_t* data() const {
+            return payload;
+        }
+
+        size_t size() const {
+            return len;
+        }
+
+        /* Longest datagram the buffers of the ring deliver */
+        static constexpr size_t max_size() {
+            size_t size = 0;
+            for (size_t g = 0; g < buf_groups; ++g)
+                size = std::max(size, max_datagram(g));
+            return size;
+        }
+
+        uint8_t*      payload;
+        size_t        len;
+        uint16_t      group;
+        size_t        idx;
+        io_uring_ctx* ctx;
+        /* CLOCK_REALTIME ns of the kernel receive timestamp and of the CQE batch, see recv_timestamps */
+        int64_t       rx_ns = 0;
+        int64_t       cqe_ns = 0;
+    };
+
+    /* The tag of a recvmsg is the buffer group */
+    int process_cqe_recv(io_uring_cqe* cqe, op_data<sqe_op_recvmsg> data) {
+        auto fdidx = int(data.fdidx);
+
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            recv_ended(fdidx, cqe->res);
+
+        if (cqe->res == -ENOBUFS) {
+            debug("no buffers available\n");
+            return 0;
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_BUFFER) || cqe->res < 0) {
+            debug("recv CQE have a bad res: %d\n", cqe->res);
+            return -55;
+        }
+
+        auto group = uint16_t(data.tag);
+        auto idx = cqe->flags >> 16;
+        auto buf = buffer(group, idx);
+        auto ref_idx = buf_first[group] + idx;
+
+        /* An incrementally consumed buffer stays in the ring until the kernel clears IORING_CQE_F_BUF_MORE */
+        if (!settings.buf_incremental || !(cqe->flags & IORING_CQE_F_BUF_MORE))
+            --buf_available[group];
+
+        if constexpr (settings.buf_incremental) {
+            /* The kernel keeps consuming the buffer while it reports IORING_CQE_F_BUF_MORE: hold a reference for it */
+            if (inc_offsets[ref_idx] == 0)
+                buf_refs[ref_idx].store(1, std::memory_order_relaxed);
+            buf += inc_offsets[ref_idx];
+            metrics.recv_buffer_bytes += uint64_t(cqe->res);
+        }
+        else
+            metrics.recv_buffer_bytes += buf_classes[group].size;
+
+        auto rc = deliver_recv(cqe, fdidx, group, idx, buf);
+
+        if constexpr (settings.buf_incremental) {
+            if (cqe->flags & IORING_CQE_F_BUF_MORE)
+                inc_offsets[ref_idx] += uint32_t(cqe->res);
+            else {
+                inc_offsets[ref_idx] = 0;
+                buf_release(group, idx);
+            }
+        }
+
+        if (settings.stats_interval && ++recv_cqes % settings.stats_interval == 0)
+            debug("recv: %zu CQEs, buffer memory %zu bytes, %.1f%% of taken buffer bytes are payload, %zu truncated, "
+                  "%zu lost at buffer ends\n",
+                  recv_cqes,
+                  buffer_memory,
+                  metrics.buffer_utilization() * 100.0,
+                  metrics.recv_truncated,
+                  metrics.recv_truncated_tail);
+
+        return rc;
+    }
+
+    /* The kernel has ended the multishot recvmsg of fdidx: queue the next one right away, or once buffers are
+     * returned if the group has run dry. Re-arming into an empty ring would only get another -ENOBUFS */
+    void recv_ended(int fdidx, int res) {
+        set_recv_state(fdidx, recv_idle);
+
+        if (res == -ENOBUFS) {
+            ++metrics.recv_ended_nobufs;
+            set_recv_state(fdidx, recv_pending);
+            return;
+        }
+
+        if (res >= 0)
+            ++metrics.recv_ended_other;
+        else {
+            ++metrics.recv_ended_error;
+            debug("recv on file %d ended: %s\n", fdidx, strerror(-res));
+            /* Canceled on purpose or the socket is gone */
+            if (res == -ECANCELED || res == -EBADF)
+                return;
+            /* A re-armed request would fail the same way right away and spin the ring */
+            if (recv_error_persistent(res)) {
+                ++metrics.recv_failed;
+                debug("recv on file %d stopped\n", fdidx);
+                return;
+            }
+        }
+
+        add_recv_request(fdidx);
+    }
+
+    /* Errors of the request itself rather than of the traffic: not a socket, a socket or kernel without multishot
+     * recvmsg, a buffer class too small for the recvmsg header */
+    static bool recv_error_persistent(int res) {
+        return res == -EINVAL || res == -ENOTSOCK || res == -EOPNOTSUPP || res == -EFAULT;
+    }
+
+    void rearm_pending() {
+        for (int idx = 0; idx < int(max_files); ++idx)
+            if (recv_state[idx] == recv_pending &&
+                buf_available[recv_groups[idx]] != 0)
+                add_recv_request(idx);
+    }
+
+    void set_recv_state(int idx, uint8_t state) {
+        recv_pending_count -= recv_state[idx] == recv_pending;
+        recv_pending_count += state == recv_pending;
+        recv_state[idx] = state;
+    }
+
+    struct recv_control {
+        /* Size of the datagrams coalesced into the packet or zero if it was not coalesced */
+        uint32_t gro_segment_size = 0;
+        /* SO_TIMESTAMPNS of the packet or zero */
+        int64_t  rx_ns = 0;
+    };
+
+    /* Passes the datagrams of the message to the receive handler. A message that does not reach the handler gives
+     * its buffer back right away */
+    int deliver_recv(io_uring_cqe* cqe, int fdidx, uint16_t group, uint32_t idx, uint8_t* buf) {
+        auto drop = [&](int rc) {
+            if constexpr (!settings.buf_incremental)
+                return_buffer(group, idx);
+            return rc;
+        };
+
+        io_uring_recvmsg_out* out = io_uring_recvmsg_validate(buf, cqe->res, &msg);
+        if (!out) {
+            debug("bad recvmsg\n");
+            return drop(-2);
+        }
+
+        auto payload_len = io_uring_recvmsg_payload_length(out, cqe->res, &msg);
+        if (out->flags & MSG_TRUNC) {
+            debug("truncated msg need %u received %u\n", out->payloadlen, payload_len);
+            if (settings.buf_incremental && out->payloadlen <= max_datagram(group))
+                ++metrics.recv_truncated_tail;
+            else
+                ++metrics.recv_truncated;
+            return drop(0);
+        }
+
+        auto payload = (uint8_t*)io_uring_recvmsg_payload(out, &msg);
+        auto src = (sockaddr_in*)io_uring_recvmsg_name(out);
+        auto ref_idx = buf_first[group] + idx;
+        metrics.recv_payload_bytes += payload_len;
+
+        auto control = read_control(out);
+
+        if constexpr (settings.udp_gro) {
+            auto segment_size = control.gro_segment_size;
+            if (segment_size != 0 && payload_len > segment_size) {
+                auto segments = (payload_len + segment_size - 1) / segment_size;
+                ++metrics.gro_packets;
+                metrics.gro_segments += segments;
+
+                /* Hold all references before the first handler call: it may drop its segment right away */
+                add_buf_refs(ref_idx, segments);
+                for (uint32_t off = 0; off < payload_len; off += segment_size) {
+                    auto len = payload_len - off < segment_size ? payload_len - off : segment_size;
+                    on_receive(fdidx, src, stamped(buf_scope{payload + off, len, group, idx, this}, control));
+                }
+                return 0;
+            }
+        }
+
+        if constexpr (shared_buffers)
+            add_buf_refs(ref_idx, 1);
+
+        on_receive(fdidx, src, stamped(buf_scope{payload, payload_len, group, idx, this}, control));
+        return 0;
+    }
+
+    buf_scope&& stamped(buf_scope&& buf, const recv_control& control) {
+        if constexpr (settings.recv_timestamps) {
+            buf.rx_ns = control.rx_ns;
+            buf.cqe_ns = cqe_now_ns;
+        }
+        return std::move(buf);
+    }
+
+    /* A handler taking the fixed file index of the socket first can route per socket without lookups */
+    void on_receive(int fdidx, sockaddr_in* src, buf_scope&& buf) {
+        if constexpr (batch_handoff) {
+            static_assert(std::is_invocable_v<RH&, batch_ref&&>, "recv_batches needs a handler taking batch_type");
+
+            if (cur_batch == no_batch && !next_batch()) {
+                ++metrics.recv_batch_drops;
+                return;
+            }
+
+            /* The batch takes over the buffer reference */
+            auto& b = batches[cur_batch];
+            auto  i = b.count++;
+            b.src[i] = *src;
+            b.data[i] = buf.payload;
+            b.len[i] = uint32_t(buf.len);
+            b.file[i] = uint16_t(fdidx);
+            b.group[i] = buf.group;
+            b.buf_id[i] = uint16_t(buf.idx);
+            b.rx_ns[i] = buf.rx_ns;
+            buf.ctx = nullptr;
+
+            if (b.count == recv_batch::capacity)
+                hand_off_batch();
+        }
+        else if constexpr (std::is_invocable_v<RH&, int, sockaddr_in*, buf_scope&&>)
+            receive_h(fdidx, src, std::move(buf));
+        else
+            receive_h(src, std::move(buf));
+    }
+
+    bool next_batch() {
+        if (free_batch_count == 0)
+            returned_batches.drain([this](uint32_t idx) { free_batches[free_batch_count++] = idx; });
+        if (free_batch_count == 0)
+            return false;
+
+        cur_batch = free_batches[--free_batch_count];
+        batches[cur_batch].count = 0;
+        batches[cur_batch].cqe_ns = cqe_now_ns;
+        return true;
+    }
+
+    /* The consumer gets the batch with one call, whatever the number of datagrams in it */
+    void hand_off_batch() {
+        if (cur_batch == no_batch)
+            return;
+
+        auto idx = cur_batch;
+        cur_batch = no_batch;
+        ++metrics.recv_batches;
+        receive_h(batch_ref{this, idx});
+    }
+
+    /* Called by batch_ref from any thread */
+    void release_batch(uint32_t idx) {
+        auto& b = batches[idx];
+        for (uint32_t i = 0; i < b.count; ++i)
+            buf_release(b.group[i], b.buf_id[i]);
+        b.count = 0;
+        returned_batches.push(idx);
+    }
+
+    void add_buf_refs(size_t ref_idx, uint32_t count) {
+        if constexpr (settings.buf_incremental)
+            buf_refs[ref_idx].fetch_add(count, std::memory_order_relaxed);
+        else
+            buf_refs[ref_idx].store(count, std::memory_order_relaxed);
+    }
+
+    recv_control read_control(io_uring_recvmsg_out* out) {
+        recv_control control;
+        if constexpr (recv_control_size == 0)
+            return control;
+
+        for (auto cmsg = io_uring_recvmsg_cmsg_firsthdr(out, &msg); cmsg;
+             cmsg = io_uring_recvmsg_cmsg_nexthdr(out, &msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                control.gro_segment_size = uint32_t(segment_size);
+            }
+            else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                control.rx_ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
+            }
+        }
+        return control;
+    }
+
+    int process_cqe_send(io_uring_cqe* cqe, op_data<sqe_op_sendmsg> data) {
+        auto slot_idx = uint16_t(data.tag);
+        free_send_slots[free_send_count++] = slot_idx;
+
+        if (cqe->res < 0) {
+            ++metrics.send_errors;
+            debug("send failed: %s\n", strerror(-cqe->res));
+            return cqe->res;
+        }
+
+        ++metrics.sends_completed;
+        metrics.bytes_sent += uint64_t(cqe->res);
+        return 0;
+    }
+
+    int process_cqe_send_zc(io_uring_cqe* cqe, op_data<sqe_op_send_zc>) {
+        if constexpr (zc_enabled)
+            return zc.process_cqe(cqe);
+        else
+            return -1;
+    }
+
+    static int64_t monotonic_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    void arm_tick() {
+        io_uring_sqe* sqe = next_sqe();
+        tick_arm_pending = !sqe;
+        if (!sqe)
+            return;
+
+        tick_ts = {.tv_sec = tick_deadline / 1000000000, .tv_nsec = tick_deadline % 1000000000};
+        io_uring_prep_timeout(sqe, &tick_ts, 0, IORING_TIMEOUT_ABS);
+        sqe->user_data = op_data<sqe_op_tick>{.tag = tick_generation & op_data<sqe_op_tick>::max_tag}.encode();
+    }
+
+    int process_cqe_tick(io_uring_cqe* cqe, op_data<sqe_op_tick> data) {
+        if (tick_period == 0 || data.tag != (tick_generation & op_data<sqe_op_tick>::max_tag))
+            return 0;
+
+        if (cqe->res != -ETIME) {
+            debug("tick timeout failed: %s, ticks stopped\n", strerror(-cqe->res));
+            stop_ticks();
+            return cqe->res;
+        }
+
+        auto start = monotonic_ns();
+        auto late = uint64_t(std::max<int64_t>(start - tick_deadline, 0));
+        ++metrics.ticks;
+        metrics.tick_jitter_sum_ns += late;
+        metrics.tick_jitter_max_ns = std::max(metrics.tick_jitter_max_ns, late);
+        auto bucket = std::min<size_t>(size_t(std::bit_width(late / 1000)), std::size(metrics.tick_jitter_hist) - 1);
+        ++metrics.tick_jitter_hist[bucket];
+
+        /* Timer callbacks and the tick handler may stop or restart the ticks */
+        auto generation = tick_generation;
+        wheel.advance(++tick_periods);
+        if (generation != tick_generation)
+            return 0;
+        tick_h(tick_info{.tick = tick_count++, .deadline_ns = tick_deadline, .late_ns = int64_t(late)});
+        if (generation != tick_generation)
+            return 0;
+
+        tick_deadline += tick_period;
+        auto end = monotonic_ns();
+        if (end >= tick_deadline) {
+            auto missed = (end - tick_deadline) / tick_period + 1;
+            ++metrics.tick_overruns;
+            metrics.ticks_skipped += uint64_t(missed);
+            tick_deadline += missed * tick_period;
+            tick_periods += uint64_t(missed);
+        }
+
+        arm_tick();
+        return 0;
+    }
+
+    int process_cqe_coro(io_uring_cqe* cqe, op_data<sqe_op_coro>) {
+        ++metrics.coro_resumes;
+        resume_coro(cqe);
+        return 0;
+    }
+
+    int process_cqe_waiter(io_uring_cqe* cqe, op_data<sqe_op_waiter>) {
+        auto waiter = user_data_waiter(cqe->user_data);
+        waiter->res = cqe->res;
+        waiter->flags = cqe->flags;
+        waiter->complete(*waiter);
+        return 0;
+    }
+
+    template <sqe_op Op, auto Fn>
+    struct builtin_op {
+        static constexpr sqe_op op = Op;
+
+        static int call(io_uring_ctx& ctx, io_uring_cqe* cqe) {
+            return (ctx.*Fn)(cqe, op_data<Op>::decode(cqe->user_data));
+        }
+    };
+
+    using builtin_ops = std::tuple<builtin_op<sqe_op_recvmsg, &io_uring_ctx::process_cqe_recv>,
+                                   builtin_op<sqe_op_sendmsg, &io_uring_ctx::process_cqe_send>,
+                                   builtin_op<sqe_op_send_zc, &io_uring_ctx::process_cqe_send_zc>,
+                                   builtin_op<sqe_op_tick, &io_uring_ctx::process_cqe_tick>,
+                                   builtin_op<sqe_op_coro, &io_uring_ctx::process_cqe_coro>,
+                                   builtin_op<sqe_op_waiter, &io_uring_ctx::process_cqe_waiter>>;
+
+    /* The built-in ops and the ones of OH are dispatched the same way, see op_table */
+    int process_cqe(io_uring_cqe* cqe) {
+        auto op = user_data_op(cqe->user_data);
+        int  rc = -1;
+
+        bool handled = [&]<typename... Ops>(std::type_identity<std::tuple<Ops...>>) {
+            return ((op == Ops::op && (rc = Ops::call(*this, cqe), true)) || ...);
+        }(std::type_identity<builtin_ops>{});
+
+        if (handled || user_ops.dispatch(cqe, rc))
+            return rc;
+
+        debug("CQE of unknown op %u\n", unsigned(op));
+        return -1;
+    }
+
+    struct send_slot {
+        msghdr      msg;
+        iovec       iov;
+        sockaddr_in dst;
+        int         fdidx;
+        uint16_t    segment_size;
+        uint16_t    segments;
+
+        alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(uint16_t))];
+    };
+
+    static constexpr uint32_t no_send_slot = UINT32_MAX;
+
+    enum recv_state_t : uint8_t {
+        recv_idle,
+        recv_armed,
+        /* Has to be re-armed: the ring ran out of buffers or the SQ was full */
+        recv_pending,
+    };
+
+private:
+    io_uring ring = {};
+    io_uring_buf_ring* buf_rings[buf_groups] = {};
+    mapped_memory buf_mem[buf_groups];
+    io_uring_cqe* cqes[cq_depth];
+
+    msghdr msg = {.msg_namelen = sizeof(sockaddr_in), .msg_controllen = recv_control_size};
+    unsigned files_count = 0;
+    uint16_t recv_groups[max_files] = {};
+    uint8_t  recv_state[max_files] = {};
+    uint32_t recv_pending_count = 0;
+    /* Buffers of each group the kernel can pick: provided ones minus the ones taken by received messages */
+    uint32_t buf_available[buf_groups] = {};
+    std::atomic<uint32_t> buf_refs[shared_buffers ? total_buffers : 1];
+    /* Bytes of each buffer already consumed by the kernel in incremental mode */
+    uint32_t inc_offsets[settings.buf_incremental ? total_buffers : 1] = {};
+    uint64_t recv_cqes = 0;
+
+    /* The thread which constructs the context drives the ring */
+    std::thread::id ring_thread = std::this_thread::get_id();
+    uint64_t ring_id = ++ring_ids;
+    std::atomic<uint32_t> next_lane = 0;
+    std::unique_ptr<return_lane[]> lanes = std::make_unique<return_lane[]>(return_lanes);
+    uint32_t local_returns[total_buffers];
+    uint32_t local_returns_count = 0;
+
+    static constexpr uint32_t batches_count = batch_handoff ? settings.recv_batches : 1;
+    static constexpr uint32_t no_batch = UINT32_MAX;
+    std::unique_ptr<recv_batch[]> batches = batch_handoff ? std::make_unique<recv_batch[]>(batches_count) : nullptr;
+    uint32_t free_batches[batches_count] = {};
+    uint32_t free_batch_count = 0;
+    uint32_t cur_batch = no_batch;
+    buf_return_lane<std::bit_ceil(batches_count)> returned_batches;
+
+    /* Time of the CQE batch in process, with recv_timestamps only */
+    int64_t cqe_now_ns = 0;
+
+    uint8_t* send_bufs = nullptr;
+    send_slot send_slots[send_depth];
+    uint16_t free_send_slots[send_depth];
+    uint32_t free_send_count = 0;
+    /* Last send queued since the previous submit, GSO segments may be appended to it */
+    uint32_t gso_tail = no_send_slot;
+    bool     gso_available = false;
+
+    using zc_sender_t = std::conditional_t<zc_enabled,
+                                           zc_sender<settings.zc_buffers, settings.zc_buf_size, settings.zc_send_depth>,
+                                           no_zc_sender>;
+    [[no_unique_address]] zc_sender_t zc;
+
+    /* Ticks run at most a few hundred times a second, so the handler is type-erased instead of one more parameter */
+    std::function<void(const tick_info&)> tick_h;
+    int64_t tick_period = 0;
+    int64_t tick_deadline = 0;
+    uint64_t tick_generation = 0;
+    uint64_t tick_count = 0;
+    /* Tick periods passed, skipped ones included: the time of the timer wheel */
+    uint64_t tick_periods = 0;
+    bool tick_arm_pending = false;
+    /* Read by the kernel when the timeout SQE is submitted */
+    __kernel_timespec tick_ts = {};
+    timer_wheel wheel;
+
+    ring_metrics metrics;
+
+    RH receive_h;
+    DH debug;
+    OH user_ops;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct sock_options {
+    /* Allow several sockets (one per shard) to bind the same port */
+    bool reuseport = false;
+    /* CPU served by each socket of the reuseport group, in bind order. If not empty, attach a classic BPF
+     * program which delivers a packet to the socket of the CPU that received it */
+    std::span<const int> steering_cpus = {};
+    /* Let the kernel coalesce datagrams of a flow into UDP GRO super-packets, see uring_settings::udp_gro */
+    bool udp_gro = false;
+    /* Timestamp received datagrams in the kernel (SO_TIMESTAMPNS), see uring_settings::recv_timestamps */
+    bool rx_timestamps = false;
+};
+
+/* Builds: if (cpu == cpus[0]) return 0; ... if (cpu == cpus[n-1]) return n-1; return cpu % n;
+ * The kernel falls back to the default reuseport hash if the returned index is out of the group */
+inline std::vector<sock_filter> make_cpu_steering_prog(std::span<const int> cpus) {
+    std::vector<sock_filter> prog;
+    prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_CPU)));
+
+    for (uint32_t i = 0; i < cpus.size(); ++i) {
+        prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, uint32_t(cpus[i]), 0, 1));
+        prog.push_back(BPF_STMT(BPF_RET | BPF_K, i));
+    }
+
+    prog.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, uint32_t(cpus.size())));
+    prog.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    return prog;
+}
+
+inline int attach_cpu_steering(int sock, std::span<const int> cpus) {
+    if (cpus.empty() || cpus.size() > (BPF_MAXINSNS - 3) / 2) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    auto prog = make_cpu_steering_prog(cpus);
+    sock_fprog fprog{
+        .len    = uint16_t(prog.size()),
+        .filter = prog.data(),
+    };
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog));
+}
+
+inline int setup_sock(uint16_t port, sock_options opts = {}) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1)
+        return sock;
+
+    auto fail = [sock] {
+        auto err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    };
+
+    if (opts.reuseport) {
+        int on = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+            return fail();
+    }
+
+    if (opts.udp_gro) {
+        int on = 1;
+        if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+            return fail();
+    }
+
+    if (opts.rx_timestamps) {
+        int on = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+            return fail();
+    }
+
+    sockaddr_in addr{
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+        .sin_addr   = {INADDR_ANY},
+    };
+
+    int rc = bind(sock, (sockaddr*)&addr, sizeof(addr));
+    if (rc == -1)
+        return fail();
+
+    /* The program is shared by the whole group, attaching it again just replaces it */
+    if (!opts.steering_cpus.empty() && attach_cpu_steering(sock, opts.steering_cpus) == -1)
+        return fail();
+
+    return sock;
+}
+
+/* UDP_SEGMENT is accepted by kernels which can segment UDP GSO super-buffers (4.18+) */
+inline bool udp_gso_supported() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1)
+        return false;
+
+    int  gso_size = 1200;
+    bool supported = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == 0;
+    close(sock);
+    return supported;
+}
+
+/* The 6 bytes of an IPv4 endpoint, address and port in network byte order */
+inline uint64_t endpoint_key(const sockaddr_in& src) {
+    return uint64_t(src.sin_addr.s_addr) << 16 | src.sin_port;
+}
+
+/* Fibonacci hash of the client address and port, take the top bits for a table index */
+inline uint64_t client_hash(const sockaddr_in& src) {
+    return endpoint_key(src) * 0x9e3779b97f4a7c15ull;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum class mem_backing : uint8_t {
+    regular,
+    /* Anonymous memory advised with MADV_HUGEPAGE, khugepaged or the fault path back it with huge pages */
+    transparent_huge,
+    /* MAP_HUGETLB pages from the reserved pool (vm.nr_hugepages), transparent_huge when the pool is empty */
+    hugetlb,
+};
+
+inline const char* mem_backing_name(mem_backing backing) {
+    switch (backing) {
+    case mem_backing::regular: return "regular";
+    case mem_backing::transparent_huge: return "transparent huge";
+    case mem_backing::hugetlb: return "hugetlb";
+    }
+    return "unknown";
+}
+
+/* Default huge page size of x86-64 and arm64 with 4KB pages */
+inline constexpr size_t huge_page_size = size_t(2) << 20;
+
+struct mapped_memory {
+    void*       addr = nullptr;
+    size_t      size = 0;
+    /* The backing actually used, lower than the requested one after a fallback */
+    mem_backing backing = mem_backing::regular;
+    /* -1 if the memory is not bound to a node */
+    int         numa_node = -1;
+};
+
+/* NUMA node of the CPU the calling thread runs on, call it after pinning the thread */
+inline int current_numa_node() {
+    unsigned cpu = 0, node = 0;
+    if (getcpu(&cpu, &node) == -1)
+        return -1;
+    return int(node);
+}
+
+/* Makes node the preferred node of the pages in [addr, addr + size). MPOL_PREFERRED falls back to other nodes
+ * when the node runs out of memory instead of failing the allocation (SIGBUS for hugetlb pages) like MPOL_BIND */
+inline int prefer_numa_node(void* addr, size_t size, int node) {
+    constexpr size_t bits = sizeof(unsigned long) * 8;
+
+    std::array<unsigned long, 16> mask = {};
+    if (node < 0 || size_t(node) >= mask.size() * bits)
+        return -EINVAL;
+    mask[size_t(node) / bits] = 1UL << (size_t(node) % bits);
+
+    /* The kernel reads maxnode - 1 bits */
+    if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask.data(), mask.size() * bits + 1, 0) == -1)
+        return -errno;
+    return 0;
+}
+
+inline void* map_aligned(size_t size, size_t alignment) {
+    auto mapped = mmap(nullptr, size + alignment, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mapped == MAP_FAILED)
+        return MAP_FAILED;
+
+    auto begin = uintptr_t(mapped);
+    auto aligned = (begin + alignment - 1) & ~(alignment - 1);
+    if (aligned != begin)
+        munmap(mapped, aligned - begin);
+    if (auto tail = begin + alignment - aligned)
+        munmap((void*)(aligned + size), tail);
+    return (void*)aligned;
+}
+
+/*
+ * Maps size bytes of anonymous memory with the requested backing, falling back from hugetlb to transparent huge
+ * pages and from them to regular pages. With numa_node >= 0 the pages are placed on that node.
+ * Every page is touched before returning, so the memory is allocated under the policy of this thread and the
+ * receive path does not take page faults. Returns addr == nullptr with errno set if even regular mmap fails.
+ */
+inline mapped_memory map_memory(size_t size, mem_backing backing, int numa_node = -1) {
+    mapped_memory mem{.size = size, .backing = backing};
+    if (backing != mem_backing::regular)
+        mem.size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+
+    void* addr = MAP_FAILED;
+    if (backing == mem_backing::hugetlb) {
+        addr = mmap(nullptr, mem.size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED)
+            mem.backing = mem_backing::transparent_huge;
+    }
+
+    if (mem.backing == mem_backing::transparent_huge) {
+        addr = map_aligned(mem.size, huge_page_size);
+        if (addr != MAP_FAILED && madvise(addr, mem.size, MADV_HUGEPAGE) == -1)
+            mem.backing = mem_backing::regular;
+    }
+    else if (mem.backing == mem_backing::regular)
+        addr = mmap(nullptr, mem.size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if (addr == MAP_FAILED)
+        return {};
+    mem.addr = addr;
+
+    if (numa_node >= 0 && prefer_numa_node(addr, mem.size, numa_node) == 0)
+        mem.numa_node = numa_node;
+
+    auto page = size_t(sysconf(_SC_PAGESIZE));
+    for (size_t off = 0; off < mem.size; off += page)
+        ((volatile uint8_t*)addr)[off] = 0;
+
+    return mem;
+}
+
+inline void unmap_memory(mapped_memory& mem) {
+    if (mem.addr)
+        munmap(mem.addr, mem.size);
+    mem = {};
+}
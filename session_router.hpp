@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <netinet/in.h>
+
+#include "net.hpp"
+
+/*
+ * Sends every packet of a client to the same worker, so per-session state is only ever touched by one thread and
+ * needs no locks. Clients are hashed into buckets, every bucket has an owner worker and a count of its packets
+ * queued or in processing, both in one atomic word. migrate() only sets the target owner: the bucket moves with the
+ * first packet routed after the old owner has finished all of its packets, which makes the old owner's work happen
+ * before the new owner's.
+ */
+class session_router {
+public:
+    static constexpr unsigned bucket_bits = 12;
+    static constexpr size_t   buckets = size_t(1) << bucket_bits;
+
+    static size_t bucket(const sockaddr_in& src) {
+        return size_t(client_hash(src) >> (64 - bucket_bits));
+    }
+
+    explicit session_router(uint32_t iworkers):
+        workers(iworkers ? iworkers : 1), table(std::make_unique<entry[]>(buckets)) {
+        for (size_t b = 0; b < buckets; ++b) {
+            auto owner = uint32_t(b % workers);
+            table[b].state.store(pack(owner, 0), std::memory_order_relaxed);
+            table[b].target.store(owner, std::memory_order_relaxed);
+        }
+    }
+
+    /* Producer side: the worker to queue a packet of the bucket on. Call done() after the packet is processed */
+    uint32_t route(size_t bucket) {
+        auto& e = table[bucket];
+        auto  state = e.state.load(std::memory_order_relaxed);
+        while (true) {
+            auto owner = owner_of(state);
+            auto pending = pending_of(state);
+            if (pending == 0)
+                owner = e.target.load(std::memory_order_relaxed);
+
+            if (e.state.compare_exchange_weak(
+                    state, pack(owner, pending + 1), std::memory_order_acquire, std::memory_order_relaxed))
+                return owner;
+        }
+    }
+
+    /* Worker side, after processing a packet routed with route() */
+    void done(size_t bucket) {
+        table[bucket].state.fetch_sub(1, std::memory_order_release);
+    }
+
+    /* Explicit rebalancing: later packets of the bucket go to worker once the current owner is done with its own */
+    void migrate(size_t bucket, uint32_t worker) {
+        table[bucket].target.store(worker % workers, std::memory_order_relaxed);
+    }
+
+    uint32_t owner(size_t bucket) const {
+        return owner_of(table[bucket].state.load(std::memory_order_relaxed));
+    }
+
+    uint32_t workers_count() const {
+        return workers;
+    }
+
+private:
+    /* | owner (16 bits) | pending (48 bits) | */
+    static constexpr uint64_t pack(uint32_t owner, uint64_t pending) {
+        return uint64_t(owner) << 48 | pending;
+    }
+
+    static constexpr uint32_t owner_of(uint64_t state) {
+        return uint32_t(state >> 48);
+    }
+
+    static constexpr uint64_t pending_of(uint64_t state) {
+        return state & ((uint64_t(1) << 48) - 1);
+    }
+
+    struct entry {
+        std::atomic<uint64_t> state;
+        std::atomic<uint32_t> target;
+    };
+
+    uint32_t                 workers;
+    std::unique_ptr<entry[]> table;
+};
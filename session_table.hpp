@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <netinet/in.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "net.hpp"
+
+/*
+ * Fixed capacity hash table of per-client state keyed by endpoint_key(), for one thread. Open addressing over
+ * groups of 16 slots with a control byte per slot: empty, deleted, or 7 bits of the hash of the key in the slot, so a
+ * probe compares 16 control bytes with one SSE2 compare and touches a key only on a control byte match. Keys and
+ * value indices live in the slot arrays, the values themselves in an arena sized for capacity values up front.
+ * Nothing allocates after construction: inserting into a full arena fails. Erasing leaves tombstones, which lengthen
+ * every probe passing them, so once they hold half of the slots without a session the table is rehashed in place.
+ */
+template <typename V>
+class session_table {
+public:
+    static constexpr size_t group_size = 16;
+
+    explicit session_table(size_t icapacity):
+        max_values(std::max<size_t>(icapacity, 1)),
+        groups(std::bit_ceil((max_values * 8 / 7 + group_size) / group_size)),
+        ctrl(std::make_unique<int8_t[]>(groups * group_size)),
+        keys(std::make_unique<uint64_t[]>(groups * group_size)),
+        value_idx(std::make_unique<uint32_t[]>(groups * group_size)),
+        values(std::make_unique<V[]>(max_values)),
+        last_seen(std::make_unique<int64_t[]>(max_values)),
+        free_values(std::make_unique<uint32_t[]>(max_values)) {
+        memset(ctrl.get(), ctrl_empty, groups * group_size);
+        for (size_t i = 0; i < max_values; ++i)
+            free_values[i] = uint32_t(max_values - 1 - i);
+        free_count = max_values;
+    }
+
+    V* find(uint64_t key) {
+        auto slot = find_slot(key, hash(key));
+        return slot == no_slot ? nullptr : &values[value_idx[slot]];
+    }
+
+    /*
+     * Finds the session of key or creates it with a value initialized V, and marks it seen at now. Returns nullptr
+     * if the session is new and the arena is full
+     */
+    V* touch(uint64_t key, int64_t now, bool* inserted = nullptr) {
+        auto h = hash(key);
+        auto slot = find_slot(key, h);
+        if (inserted)
+            *inserted = slot == no_slot;
+
+        if (slot == no_slot) {
+            if (free_count == 0)
+                return nullptr;
+            if (deleted * 2 >= groups * group_size - count)
+                drop_tombstones();
+            slot = free_slot(h);
+            if (ctrl[slot] == ctrl_deleted)
+                --deleted;
+
+            auto idx = free_values[--free_count];
+            ctrl[slot] = h2(h);
+            keys[slot] = key;
+            value_idx[slot] = idx;
+            values[idx] = V{};
+            ++count;
+        }
+
+        auto idx = value_idx[slot];
+        last_seen[idx] = now;
+        return &values[idx];
+    }
+
+    V* touch(const sockaddr_in& src, int64_t now, bool* inserted = nullptr) {
+        return touch(endpoint_key(src), now, inserted);
+    }
+
+    bool erase(uint64_t key) {
+        auto slot = find_slot(key, hash(key));
+        if (slot == no_slot)
+            return false;
+        erase_slot(slot);
+        return true;
+    }
+
+    /*
+     * Erases the sessions not seen for longer than idle. Checks max_slots slots from where the previous call stopped,
+     * so the cost of expiry can be spread over packets. Returns the number of sessions erased
+     */
+    size_t expire(int64_t now, int64_t idle, size_t max_slots) {
+        size_t expired = 0;
+        auto   slots = groups * group_size;
+        for (size_t i = 0; i < std::min(max_slots, slots); ++i) {
+            auto slot = expire_cursor;
+            expire_cursor = (expire_cursor + 1) & (slots - 1);
+            if (ctrl[slot] >= 0 && now - last_seen[value_idx[slot]] > idle) {
+                erase_slot(slot);
+                ++expired;
+            }
+        }
+        return expired;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    size_t capacity() const {
+        return max_values;
+    }
+
+    size_t tombstones() const {
+        return deleted;
+    }
+
+private:
+    static constexpr int8_t ctrl_empty = -128;
+    static constexpr int8_t ctrl_deleted = -2;
+    static constexpr size_t no_slot = SIZE_MAX;
+
+    /* Murmur3's finalizer, unrelated to client_hash(): session_router picks the worker of a client from the top bits
+     * of client_hash(), so with the same hash a worker's table would only see keys of a few home groups */
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    /* The low 7 of the top bits not taken by the group index */
+    int8_t h2(uint64_t h) const {
+        return int8_t((h >> (57 - std::countr_zero(groups))) & 0x7f);
+    }
+
+    size_t h1(uint64_t h) const {
+        return groups == 1 ? 0 : size_t(h >> (64 - std::countr_zero(groups)));
+    }
+
+#if defined(__SSE2__)
+    static uint32_t match_byte(const int8_t* group, int8_t value) {
+        auto ctrls = _mm_loadu_si128((const __m128i*)group);
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrls, _mm_set1_epi8(value))));
+    }
+
+    /* Empty and deleted have the sign bit set */
+    static uint32_t match_free(const int8_t* group) {
+        return uint32_t(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group)));
+    }
+#else
+    static uint32_t match_byte(const int8_t* group, int8_t value) {
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < group_size; ++i)
+            mask |= uint32_t(group[i] == value) << i;
+        return mask;
+    }
+
+    static uint32_t match_free(const int8_t* group) {
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < group_size; ++i)
+            mask |= uint32_t(group[i] < 0) << i;
+        return mask;
+    }
+#endif
+
+    /* Groups are probed one after another until one with an empty slot, which ends the chain of every key */
+    size_t find_slot(uint64_t key, uint64_t h) const {
+        auto tag = h2(h);
+        auto g = h1(h);
+        for (size_t probes = 0; probes < groups; ++probes, g = (g + 1) & (groups - 1)) {
+            auto group = &ctrl[g * group_size];
+            for (auto match = match_byte(group, tag); match; match &= match - 1) {
+                auto slot = g * group_size + size_t(std::countr_zero(match));
+                if (keys[slot] == key)
+                    return slot;
+            }
+            if (match_byte(group, ctrl_empty))
+                return no_slot;
+        }
+        return no_slot;
+    }
+
+    /* The first empty or deleted slot of the key's chain, there is one as long as the arena is not full */
+    size_t free_slot(uint64_t h) const {
+        auto g = h1(h);
+        while (true) {
+            if (auto free = match_free(&ctrl[g * group_size]))
+                return g * group_size + size_t(std::countr_zero(free));
+            g = (g + 1) & (groups - 1);
+        }
+    }
+
+    /* A group with an empty slot ends every chain passing it, so no chain runs past the freed slot and it can be
+     * empty again instead of a tombstone */
+    void erase_slot(size_t slot) {
+        auto group = &ctrl[slot / group_size * group_size];
+        if (match_byte(group, ctrl_empty))
+            ctrl[slot] = ctrl_empty;
+        else {
+            ctrl[slot] = ctrl_deleted;
+            ++deleted;
+        }
+        free_values[free_count++] = value_idx[slot];
+        --count;
+    }
+
+    /* Groups from the key's home group to the group of slot */
+    size_t probe_distance(size_t slot, uint64_t h) const {
+        return (slot / group_size - h1(h)) & (groups - 1);
+    }
+
+    /*
+     * Rehash in place, as Abseil's DropDeletesWithoutResize(): tombstones become empty and sessions are marked
+     * deleted, then every marked session moves to the first free slot of its chain. A session moving into a marked
+     * slot swaps with it and the session swapped in is placed next. The groups before the one a session lands in hold
+     * placed sessions only, which stay, so every chain still ends at its first group with an empty slot. Values stay
+     * in the arena, only keys and value indices move. An expiry round may see a session twice or not at all.
+     */
+    void drop_tombstones() {
+        auto slots = groups * group_size;
+        for (size_t i = 0; i < slots; ++i)
+            ctrl[i] = ctrl[i] >= 0 ? ctrl_deleted : ctrl_empty;
+
+        for (size_t i = 0; i < slots; ++i) {
+            if (ctrl[i] != ctrl_deleted)
+                continue;
+
+            auto h = hash(keys[i]);
+            auto target = free_slot(h);
+            if (probe_distance(target, h) == probe_distance(i, h)) {
+                ctrl[i] = h2(h);
+                continue;
+            }
+
+            auto was_empty = ctrl[target] == ctrl_empty;
+            ctrl[target] = h2(h);
+            std::swap(keys[i], keys[target]);
+            std::swap(value_idx[i], value_idx[target]);
+            if (was_empty)
+                ctrl[i] = ctrl_empty;
+            else
+                --i;
+        }
+        deleted = 0;
+    }
+
+    size_t max_values;
+    size_t groups;
+
+    std::unique_ptr<int8_t[]>   ctrl;
+    std::unique_ptr<uint64_t[]> keys;
+    std::unique_ptr<uint32_t[]> value_idx;
+
+    std::unique_ptr<V[]>        values;
+    std::unique_ptr<int64_t[]>  last_seen;
+    std::unique_ptr<uint32_t[]> free_values;
+    size_t                      free_count = 0;
+
+    size_t count = 0;
+    size_t deleted = 0;
+    size_t expire_cursor = 0;
+};
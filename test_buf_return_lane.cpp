@@ -0,0 +1,92 @@
+#include <atomic>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <iostream>
+
+#include "buf_return_lane.hpp"
+
+/*
+ * Stress test of buf_return_lane, meant to run under ThreadSanitizer (cmake -DURING_TSAN=ON): --producers threads
+ * (default 3) share one small lane and push --count ids each while the consumer drains it, as pool workers do when
+ * they outnumber buf_return_lanes. Exits with 1 if an id is lost or duplicated or the ids of a producer come out of
+ * order.
+ */
+
+struct test_config {
+    uint32_t producers = 3;
+    uint32_t count = 1000000;
+};
+
+/* Small enough to be found full now and then */
+using lane_type = buf_return_lane<256>;
+
+/* id: | producer (8 bits) | sequence number (24 bits) | */
+constexpr uint32_t seq_bits = 24;
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--producers N] [--count N]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    test_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--producers")
+            cfg.producers = uint32_t(std::stoul(argv[++i]));
+        else if (arg == "--count")
+            cfg.count = uint32_t(std::stoul(argv[++i]));
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.producers == 0 || cfg.producers > 255 || cfg.count == 0 || cfg.count >= 1u << seq_bits) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    lane_type                lane;
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < cfg.producers; ++p)
+        producers.emplace_back([&lane, &cfg, p] {
+            for (uint32_t seq = 0; seq < cfg.count; ++seq)
+                while (!lane.push(p << seq_bits | seq))
+                    std::this_thread::yield();
+        });
+
+    /* Next sequence number expected from every producer */
+    std::vector<uint32_t> next(cfg.producers, 0);
+    uint64_t              total = uint64_t(cfg.producers) * cfg.count;
+    uint64_t              received = 0;
+    uint64_t              errors = 0;
+    while (received < total) {
+        auto drained = lane.drain([&](uint32_t id) {
+            auto p = id >> seq_bits;
+            auto seq = id & ((1u << seq_bits) - 1);
+            if (p >= cfg.producers || seq != next[p]) {
+                if (errors++ < 10)
+                    printf("unexpected id %u:%u\n", p, seq);
+                return;
+            }
+            ++next[p];
+        });
+        received += drained;
+        if (drained == 0)
+            std::this_thread::yield();
+    }
+
+    for (auto& t : producers)
+        t.join();
+
+    if (lane.drain([](uint32_t) {}) != 0)
+        ++errors;
+
+    printf("%u producers: %lu ids received, %lu errors\n", cfg.producers, received, errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cpu_affinity.hpp"
+#include "net.hpp"
+
+/*
+ * Checks the reuseport CPU steering of setup_sock(): binds one SO_REUSEPORT socket per allowed CPU with the steering
+ * program attached, sends --count datagrams from a thread pinned to each CPU and expects the socket of a CPU to get
+ * exactly the datagrams sent from it. Loopback delivers a datagram on the CPU of its sender, so the CPU seen by the
+ * program is the sender's. Exits with 1 if a datagram went to another socket or was lost, and with 77 (skipped)
+ * if fewer than 2 CPUs are allowed, where every datagram goes to the one socket whatever the steering does.
+ */
+
+/* The exit status ctest takes as skipped through the SKIP_RETURN_CODE property */
+constexpr int exit_skipped = 77;
+
+struct test_config {
+    uint16_t port = 17400;
+    size_t   count = 1000;
+};
+
+/* Every datagram carries the index of its sender's CPU */
+void send_from(int cpu, uint32_t sender, const test_config& cfg, std::atomic<bool>& failed) {
+    if (auto rc = pin_thread_to_cpu(cpu)) {
+        fprintf(stderr, "cannot pin to cpu %d: %s\n", cpu, strerror(rc));
+        failed = true;
+        return;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in dst{
+        .sin_family = AF_INET,
+        .sin_port   = htons(cfg.port),
+        .sin_addr   = {htonl(INADDR_LOOPBACK)},
+    };
+    for (size_t i = 0; i < cfg.count; ++i)
+        if (sendto(sock, &sender, sizeof(sender), 0, (sockaddr*)&dst, sizeof(dst)) == -1) {
+            fprintf(stderr, "sendto from cpu %d failed: %s\n", cpu, strerror(errno));
+            failed = true;
+            break;
+        }
+    close(sock);
+}
+
+/* Receives until every datagram has arrived or nothing came for a second. received[socket][sender] */
+std::vector<std::vector<size_t>> drain(const std::vector<int>& socks, size_t expected) {
+    std::vector<std::vector<size_t>> received(socks.size(), std::vector<size_t>(socks.size(), 0));
+    std::vector<pollfd>              fds;
+    for (auto sock : socks)
+        fds.push_back({.fd = sock, .events = POLLIN});
+
+    size_t total = 0;
+    while (total < expected && poll(fds.data(), fds.size(), 1000) > 0)
+        for (size_t s = 0; s < socks.size(); ++s) {
+            uint32_t sender;
+            while (recv(socks[s], &sender, sizeof(sender), MSG_DONTWAIT) == sizeof(sender)) {
+                ++total;
+                if (sender < socks.size())
+                    ++received[s][sender];
+            }
+        }
+    return received;
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--port PORT] [--count N]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    test_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--port")
+            cfg.port = uint16_t(std::stoul(argv[++i]));
+        else if (arg == "--count")
+            cfg.count = std::stoul(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    auto cpus = allowed_cpus();
+    if (cpus.empty()) {
+        std::cerr << "sched_getaffinity() failed: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    if (cpus.size() < 2) {
+        printf("skipped: steering needs at least 2 allowed CPUs, %zu allowed\n", cpus.size());
+        return exit_skipped;
+    }
+
+    std::vector<int> socks;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        int sock = setup_sock(cfg.port, {.reuseport = true, .steering_cpus = cpus});
+        if (sock == -1) {
+            std::cerr << "cannot bind socket " << i << " to port " << cfg.port << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        int rcvbuf = 4 << 20;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        socks.push_back(sock);
+    }
+
+    std::atomic<bool>        failed = false;
+    std::vector<std::thread> senders;
+    for (uint32_t i = 0; i < cpus.size(); ++i)
+        senders.emplace_back(send_from, cpus[i], i, std::cref(cfg), std::ref(failed));
+
+    auto received = drain(socks, cpus.size() * cfg.count);
+    for (auto& t : senders)
+        t.join();
+
+    for (size_t s = 0; s < socks.size(); ++s) {
+        size_t own = received[s][s];
+        size_t foreign = 0;
+        for (size_t sender = 0; sender < socks.size(); ++sender)
+            if (sender != s)
+                foreign += received[s][sender];
+
+        printf("socket %2zu (cpu %3d): %zu of %zu own datagrams, %zu from other cpus\n",
+               s,
+               cpus[s],
+               own,
+               cfg.count,
+               foreign);
+        if (own != cfg.count || foreign != 0)
+            failed = true;
+        close(socks[s]);
+    }
+
+    if (failed) {
+        printf("steering failed\n");
+        return 1;
+    }
+}
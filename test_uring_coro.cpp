@@ -0,0 +1,159 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <span>
+
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "io_uring_ctx.hpp"
+#include "uring_coro.hpp"
+
+/*
+ * Loopback test of uring_task: a receiver coroutine waits in recv_from() on a UDP socket while a sender coroutine
+ * sleeps in sleep_for() and then sends a datagram to the same socket with send_datagram(), all resumed from
+ * run_once(). Checks the results of every co_await, that a second round of coroutines reuses the frames of the first
+ * from frame_pool, and that an awaitable which gets no SQE resumes at once with -EBUSY. Exits with 1 on any failure.
+ */
+
+using namespace std::chrono_literals;
+
+struct ignore_recv {
+    void operator()(sockaddr_in*, auto&&) const {}
+};
+
+constexpr uring_settings settings{.sq_depth = 8};
+using ctx_t = io_uring_ctx<settings, ignore_recv>;
+
+constexpr auto sleep_time = 2ms;
+
+/* Resumes at once with the frame address of the calling coroutine */
+struct frame_address {
+    void* address = nullptr;
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(uring_handle h) noexcept {
+        address = h.address();
+        return false;
+    }
+
+    void* await_resume() const noexcept {
+        return address;
+    }
+};
+
+struct round_result {
+    bool        received = false;
+    bool        sent = false;
+    void*       receiver_frame = nullptr;
+    void*       sender_frame = nullptr;
+    recv_result recv{.res = -1, .src = {}};
+    uint32_t    payload = 0;
+    int         slept = -1;
+    int64_t     slept_ns = 0;
+    int         send_res = -1;
+};
+
+uring_task receiver(ctx_t& ctx, round_result& r) {
+    r.receiver_frame = co_await frame_address{};
+    r.recv = co_await ctx.recv_from(0, std::span((uint8_t*)&r.payload, sizeof(r.payload)));
+    r.received = true;
+}
+
+uring_task sender(ctx_t& ctx, sockaddr_in dst, uint32_t value, round_result& r) {
+    r.sender_frame = co_await frame_address{};
+    auto start = std::chrono::steady_clock::now();
+    r.slept = co_await ctx.sleep_for(sleep_time);
+    r.slept_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    r.send_res = co_await ctx.send_datagram(0, dst, std::span((const uint8_t*)&value, sizeof(value)));
+    r.sent = true;
+}
+
+/* A ring whose SQ stays full */
+struct full_ring {
+    io_uring_sqe* get_sqe() {
+        return nullptr;
+    }
+};
+
+uring_task busy(full_ring& ring, int& recv_res, int& sleep_res, bool& done) {
+    uint8_t buf[16];
+    recv_res = (co_await recv_awaitable<full_ring>(ring, 0, buf)).res;
+    sleep_res = co_await timeout_awaitable<full_ring>(ring, 1ms);
+    done = true;
+}
+
+int check(bool ok, const char* what) {
+    if (!ok)
+        printf("failed: %s\n", what);
+    return ok ? 0 : 1;
+}
+
+int main() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in self{
+        .sin_family = AF_INET,
+        .sin_port   = 0,
+        .sin_addr   = {htonl(INADDR_LOOPBACK)},
+    };
+    socklen_t len = sizeof(self);
+    if (sock == -1 || bind(sock, (sockaddr*)&self, sizeof(self)) == -1 ||
+        getsockname(sock, (sockaddr*)&self, &len) == -1) {
+        std::cerr << "cannot bind a loopback socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    /* A lost CQE fails the test instead of hanging it */
+    alarm(10);
+
+    int errors = 0;
+    {
+        ctx_t ctx(type_c<settings>{}, ignore_recv{});
+        if (ctx.register_files(&sock, 1))
+            return 1;
+
+        round_result rounds[2];
+        for (uint32_t i = 0; i < 2; ++i) {
+            auto& r = rounds[i];
+            receiver(ctx, r);
+            sender(ctx, self, 0xc0de0000 + i, r);
+            errors += check(!r.received && !r.sent, "coroutines suspended on their first co_await");
+
+            while (!r.received || !r.sent)
+                if (ctx.run_once() < 0)
+                    return 1;
+
+            errors += check(r.slept == 0, "sleep_for() returned 0");
+            errors += check(r.slept_ns >= std::chrono::nanoseconds(sleep_time).count(), "sleep_for() slept");
+            errors += check(r.send_res == sizeof(uint32_t), "send_datagram() sent the datagram");
+            errors += check(r.recv.res == sizeof(uint32_t), "recv_from() received the datagram");
+            errors += check(r.payload == 0xc0de0000 + i, "recv_from() received the payload");
+            errors += check(r.recv.src.sin_port == self.sin_port && r.recv.src.sin_addr.s_addr == self.sin_addr.s_addr,
+                            "recv_from() reported the source");
+        }
+
+        /* Frames are freed to and taken from the head of the per-thread lists */
+        errors += check((rounds[1].receiver_frame == rounds[0].receiver_frame ||
+                         rounds[1].receiver_frame == rounds[0].sender_frame) &&
+                            (rounds[1].sender_frame == rounds[0].receiver_frame ||
+                             rounds[1].sender_frame == rounds[0].sender_frame),
+                        "frames of the first round were reused");
+    }
+
+    full_ring ring;
+    int       recv_res = 0;
+    int       sleep_res = 0;
+    bool      done = false;
+    busy(ring, recv_res, sleep_res, done);
+    errors += check(done, "awaitables without an SQE did not suspend");
+    errors += check(recv_res == -EBUSY && sleep_res == -EBUSY, "awaitables without an SQE returned -EBUSY");
+
+    close(sock);
+    printf("%s\n", errors ? "coroutine test failed" : "coroutine test passed");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include <boost/fiber/all.hpp>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "io_uring_ctx.hpp"
+#include "uring_fiber.hpp"
+
+/*
+ * Loopback test of uring_fiber_scheduler: a receiver fiber blocks in fiber_recv_from() on a UDP socket while a sender
+ * fiber sleeps and then sends a datagram to the same socket with fiber_send_to(). A writer fiber then blocks in
+ * fiber_write() --writes times on a temporary file while another fiber keeps yielding, so the scheduler switches
+ * away from fibers whose CQEs are already there. Exits with 1 on any failure.
+ */
+
+using namespace std::chrono_literals;
+
+struct test_config {
+    size_t writes = 10000;
+};
+
+struct ignore_recv {
+    void operator()(sockaddr_in*, auto&&) const {}
+};
+
+constexpr uring_settings settings{.sq_depth = 8};
+using ctx_t = io_uring_ctx<settings, ignore_recv>;
+
+constexpr auto sleep_time = 2ms;
+
+int check(bool ok, const char* what) {
+    if (!ok)
+        printf("failed: %s\n", what);
+    return ok ? 0 : 1;
+}
+
+int loopback(ctx_t& ctx, const sockaddr_in& self) {
+    recv_result recv{.res = -1, .src = {}};
+    uint32_t    payload = 0;
+    bool        sent = false;
+    boost::fibers::fiber receiver([&] {
+        recv = fiber_recv_from(ctx, 0, std::span((uint8_t*)&payload, sizeof(payload)));
+    });
+
+    int                      send_res = -1;
+    std::chrono::nanoseconds slept{};
+    boost::fibers::fiber     sender([&] {
+        auto start = std::chrono::steady_clock::now();
+        boost::this_fiber::sleep_for(sleep_time);
+        slept = std::chrono::steady_clock::now() - start;
+
+        uint32_t value = 0xf1be0000;
+        send_res = fiber_send_to(ctx, 0, self, std::span((const uint8_t*)&value, sizeof(value)));
+        sent = true;
+    });
+
+    receiver.join();
+    sender.join();
+
+    int errors = 0;
+    errors += check(sent, "sender finished");
+    errors += check(slept >= sleep_time, "sender slept");
+    errors += check(send_res == sizeof(uint32_t), "fiber_send_to() sent the datagram");
+    errors += check(recv.res == sizeof(uint32_t), "fiber_recv_from() received the datagram");
+    errors += check(payload == 0xf1be0000, "fiber_recv_from() received the payload");
+    errors += check(recv.src.sin_port == self.sin_port && recv.src.sin_addr.s_addr == self.sin_addr.s_addr,
+                    "fiber_recv_from() reported the source");
+    return errors;
+}
+
+int writes(ctx_t& ctx, const test_config& cfg) {
+    char path[] = "/tmp/test_uring_fiber.XXXXXX";
+    int  fd = mkstemp(path);
+    if (fd == -1) {
+        std::cerr << "mkstemp() failed: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    unlink(path);
+
+    size_t failed = 0;
+    bool   done = false;
+    boost::fibers::fiber writer([&] {
+        for (uint64_t i = 0; i < cfg.writes; ++i) {
+            auto res = fiber_write(ctx, fd, std::span((const uint8_t*)&i, sizeof(i)), i * sizeof(i));
+            failed += res != sizeof(i);
+        }
+        done = true;
+    });
+    boost::fibers::fiber yielder([&] {
+        while (!done)
+            boost::this_fiber::yield();
+    });
+
+    writer.join();
+    yielder.join();
+
+    std::vector<uint64_t> contents(cfg.writes);
+    auto                  size = contents.size() * sizeof(uint64_t);
+    size_t                misplaced = 0;
+    if (pread(fd, contents.data(), size, 0) != ssize_t(size))
+        misplaced = cfg.writes;
+    else
+        for (uint64_t i = 0; i < cfg.writes; ++i)
+            misplaced += contents[i] != i;
+    close(fd);
+
+    int errors = 0;
+    errors += check(failed == 0, "fiber_write() wrote every value");
+    errors += check(misplaced == 0, "the file holds every value");
+    return errors;
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--writes N]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    test_config cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "--writes")
+            cfg.writes = std::stoul(argv[++i]);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in self{
+        .sin_family = AF_INET,
+        .sin_port   = 0,
+        .sin_addr   = {htonl(INADDR_LOOPBACK)},
+    };
+    socklen_t len = sizeof(self);
+    if (sock == -1 || bind(sock, (sockaddr*)&self, sizeof(self)) == -1 ||
+        getsockname(sock, (sockaddr*)&self, &len) == -1) {
+        std::cerr << "cannot bind a loopback socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    /* A lost CQE fails the test instead of hanging it */
+    alarm(30);
+
+    /* No multishot receive is armed, it would take the datagram. The scheduler of the thread outlives the ring */
+    ctx_t ctx(type_c<settings>{}, ignore_recv{});
+    if (ctx.register_files(&sock, 1))
+        return 1;
+    boost::fibers::use_scheduling_algorithm<uring_fiber_scheduler<ctx_t>>(ctx);
+
+    int errors = loopback(ctx, self);
+    errors += writes(ctx, cfg);
+
+    printf("%s\n", errors ? "fiber test failed" : "fiber test passed");
+    return errors ? 1 : 0;
+}
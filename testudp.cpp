@@ -1,15 +1,59 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <chrono>
 
+#include "cpu_affinity.hpp"
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--port PORT] [--cpu CPU] [--count N] MESSAGE\n"
+              << "  --cpu CPU  send from a thread pinned to CPU. On loopback the packet is received on the same CPU,\n"
+              << "             so with `uring_game_serv --shards N --cpu-steering` all N packets must be counted\n"
+              << "             by the shard pinned to CPU"
+              << std::endl;
+}
+
 int main(int argc, char** argv) {
+    uint16_t    port  = 1337;
+    int         cpu   = -1;
+    size_t      count = 1;
+    const char* data  = nullptr;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--port" && i + 1 < argc)
+            port = uint16_t(std::stoul(argv[++i]));
+        else if (arg == "--cpu" && i + 1 < argc)
+            cpu = std::stoi(argv[++i]);
+        else if (arg == "--count" && i + 1 < argc)
+            count = std::stoul(argv[++i]);
+        else if (!data)
+            data = argv[i];
+        else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!data) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (cpu >= 0) {
+        if (auto rc = pin_thread_to_cpu(cpu)) {
+            std::cerr << "cannot pin to cpu " << cpu << ": " << strerror(rc) << std::endl;
+            return -1;
+        }
+    }
 
     sockaddr_in serv_addr = {
         .sin_family = AF_INET,
-        .sin_port   = htons(1337),
+        .sin_port   = htons(port),
     };
 
     inet_pton(AF_INET, "localhost", &serv_addr.sin_addr);
@@ -20,13 +64,14 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    auto data = argv[1];
-    auto len  = sendto(sock, data, strlen(data), 0, (sockaddr*)&serv_addr, sizeof(serv_addr));
-    std::cout << "send time: " << std::chrono::steady_clock::now().time_since_epoch() << std::endl;
-    if (len == -1)
-        std::cerr << "sento() syscall failed: " << strerror(errno) << std::endl;
-    else
-        std::cout << "successfully sended " << len << " bytes" << std::endl;
+    for (size_t i = 0; i < count; ++i) {
+        auto len = sendto(sock, data, strlen(data), 0, (sockaddr*)&serv_addr, sizeof(serv_addr));
+        std::cout << "send time: " << std::chrono::steady_clock::now().time_since_epoch() << std::endl;
+        if (len == -1)
+            std::cerr << "sento() syscall failed: " << strerror(errno) << std::endl;
+        else
+            std::cout << "successfully sended " << len << " bytes" << std::endl;
+    }
 
     close(sock);
     return 0;
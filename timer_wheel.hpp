@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Intrusive timer: embed it into the object the timer belongs to (session, pending resend...) and recover the object
+ * in the callback. The wheel never allocates, a node is in at most one list at a time
+ */
+struct timer_node {
+    timer_node* prev = nullptr;
+    timer_node* next = nullptr;
+    /* Wheel tick the timer fires at */
+    uint64_t    expires = 0;
+    void (*callback)(timer_node&) = nullptr;
+
+    bool armed() const {
+        return next != nullptr;
+    }
+};
+
+/*
+ * Hierarchical timing wheel (Varghese & Lauck) with 4 levels of 256 slots: a timer less than 256 ticks away goes to
+ * a slot of level 0, one further away to the level whose slot covers its expiry and is moved down whenever the level
+ * below wraps. Adding and cancelling are O(1), advancing by one tick is O(1) plus the timers fired and moved.
+ * Timers further than 2^32 ticks away wait in the last level and are placed again when it comes around.
+ * Time is in ticks of whatever drives advance(), io_uring_ctx advances its wheel once per tick period.
+ */
+class timer_wheel {
+public:
+    static constexpr unsigned slot_bits = 8;
+    static constexpr size_t   slots = size_t(1) << slot_bits;
+    static constexpr unsigned levels = 4;
+    static constexpr uint64_t max_delay = (uint64_t(1) << (slot_bits * levels)) - 1;
+
+    explicit timer_wheel(uint64_t inow = 0): now_tick(inow) {
+        for (auto& level : wheel)
+            for (auto& head : level)
+                head.prev = head.next = &head;
+    }
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    /* Fires the timer delay ticks from now, at least one tick. An armed timer is moved */
+    void add(timer_node& node, uint64_t delay, void (*callback)(timer_node&)) {
+        if (node.armed())
+            cancel(node);
+
+        node.expires = now_tick + (delay ? delay : 1);
+        node.callback = callback;
+        place(node);
+        ++armed_count;
+    }
+
+    /* Does nothing if the timer is not armed */
+    void cancel(timer_node& node) {
+        if (!node.armed())
+            return;
+
+        unlink(node);
+        --armed_count;
+    }
+
+    /* Moves the time to tick to, firing every timer which expires on the way. Callbacks may add and cancel timers.
+     * Returns the number of timers fired */
+    size_t advance(uint64_t to) {
+        size_t fired = 0;
+        while (now_tick < to) {
+            if (armed_count == 0) {
+                now_tick = to;
+                break;
+            }
+
+            ++now_tick;
+            for (unsigned level = 1; level < levels; ++level) {
+                if (index(now_tick, level - 1) != 0)
+                    break;
+                cascade(level, index(now_tick, level));
+            }
+
+            fired += fire(wheel[0][index(now_tick, 0)]);
+        }
+        return fired;
+    }
+
+    uint64_t now() const {
+        return now_tick;
+    }
+
+    size_t size() const {
+        return armed_count;
+    }
+
+private:
+    static size_t index(uint64_t tick, unsigned level) {
+        return size_t(tick >> (level * slot_bits)) & (slots - 1);
+    }
+
+    void place(timer_node& node) {
+        auto delay = node.expires - now_tick;
+        auto when = delay > max_delay ? now_tick + max_delay : node.expires;
+
+        unsigned level = 0;
+        while (level + 1 < levels && (delay >> ((level + 1) * slot_bits)) != 0)
+            ++level;
+        link(wheel[level][index(when, level)], node);
+    }
+
+    /* Places the timers of the slot again, they all go to lower levels but the ones beyond max_delay */
+    void cascade(unsigned level, size_t slot) {
+        timer_node pending;
+        splice(wheel[level][slot], pending);
+
+        while (pending.next != &pending) {
+            auto& node = *pending.next;
+            unlink(node);
+            place(node);
+        }
+    }
+
+    size_t fire(timer_node& head) {
+        timer_node expired;
+        splice(head, expired);
+
+        size_t fired = 0;
+        while (expired.next != &expired) {
+            auto& node = *expired.next;
+            unlink(node);
+            --armed_count;
+            ++fired;
+            node.callback(node);
+        }
+        return fired;
+    }
+
+    static void link(timer_node& head, timer_node& node) {
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    static void unlink(timer_node& node) {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    /* Moves the list of from to the empty list to */
+    static void splice(timer_node& from, timer_node& to) {
+        if (from.next == &from) {
+            to.prev = to.next = &to;
+            return;
+        }
+
+        to.next = from.next;
+        to.prev = from.prev;
+        to.next->prev = &to;
+        to.prev->next = &to;
+        from.prev = from.next = &from;
+    }
+
+    timer_node wheel[levels][slots];
+    uint64_t   now_tick;
+    size_t     armed_count = 0;
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <span>
+
+#include <liburing.h>
+#include <netinet/in.h>
+
+#include "uring_ops.hpp"
+
+/*
+ * Frames of uring_task coroutines: per-thread free lists of 64 byte size classes up to 1KB, bigger frames come from
+ * the heap. A coroutine started per request or per session reuses the frame of a finished one instead of a malloc
+ * on every start. Frames stay in the lists of the thread that freed them until it exits
+ */
+class frame_pool {
+public:
+    static constexpr size_t granularity = 64;
+    static constexpr size_t classes = 16;
+
+    static void* allocate(size_t size) {
+        auto cls = size_class(size);
+        if (cls >= classes)
+            return ::operator new(size);
+
+        auto& head = lists().heads[cls];
+        if (auto frame = head) {
+            head = frame->next;
+            return frame;
+        }
+        return ::operator new((cls + 1) * granularity, std::align_val_t(granularity));
+    }
+
+    static void deallocate(void* ptr, size_t size) {
+        auto cls = size_class(size);
+        if (cls >= classes) {
+            ::operator delete(ptr, size);
+            return;
+        }
+
+        auto  frame = static_cast<free_frame*>(ptr);
+        auto& head = lists().heads[cls];
+        frame->next = head;
+        head = frame;
+    }
+
+private:
+    struct free_frame {
+        free_frame* next;
+    };
+
+    struct free_lists {
+        free_frame* heads[classes] = {};
+
+        ~free_lists() {
+            for (auto head : heads)
+                while (head) {
+                    auto next = head->next;
+                    ::operator delete(head, std::align_val_t(granularity));
+                    head = next;
+                }
+        }
+    };
+
+    static size_t size_class(size_t size) {
+        return size ? (size - 1) / granularity : 0;
+    }
+
+    static free_lists& lists() {
+        thread_local free_lists l;
+        return l;
+    }
+};
+
+/*
+ * Detached coroutine driven by an io_uring_ctx: it starts running when called and its frame is freed when it returns.
+ * Every co_await of a ring awaitable queues one SQE carrying the coroutine handle and suspends, run_once() resumes the
+ * coroutine inline from the CQE loop with the result of the CQE. A coroutine must finish or stay suspended on the
+ * ring it was started on, and the ring must outlive it
+ */
+struct uring_task {
+    struct promise_type {
+        int      res = 0;
+        uint32_t flags = 0;
+
+        uring_task get_return_object() noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+
+        static void* operator new(size_t size) {
+            return frame_pool::allocate(size);
+        }
+
+        static void operator delete(void* ptr, size_t size) {
+            frame_pool::deallocate(ptr, size);
+        }
+    };
+};
+
+using uring_handle = std::coroutine_handle<uring_task::promise_type>;
+
+/* user_data of sqe_op_coro: | coroutine frame address (56 bits) | op (8 bits) |. Userspace addresses of every 64-bit
+ * Linux target fit into 56 bits, 5-level paging included */
+static_assert(sizeof(void*) == 8);
+
+inline uint64_t coro_user_data(uring_handle h) {
+    return uint64_t(reinterpret_cast<uintptr_t>(h.address())) << 8 | sqe_op_coro;
+}
+
+/* Hands the result of the CQE to the suspended coroutine and resumes it until its next co_await or its end */
+inline void resume_coro(io_uring_cqe* cqe) {
+    auto h = uring_handle::from_address(reinterpret_cast<void*>(uintptr_t(cqe->user_data >> 8)));
+    h.promise().res = cqe->res;
+    h.promise().flags = cqe->flags;
+    h.resume();
+}
+
+/*
+ * Base of the ring awaitables: gets an SQE from the ring in await_suspend() and lets the derived awaitable prepare
+ * it. Without an SQE the coroutine is not suspended and the awaitable resumes with -EBUSY. Everything the kernel
+ * reads or writes until the CQE (msghdr, address, timespec) lives in the awaitable, inside the suspended frame
+ */
+template <typename Ctx, typename Derived>
+class ring_awaitable {
+public:
+    explicit ring_awaitable(Ctx& ictx): ctx(ictx) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(uring_handle h) {
+        promise = &h.promise();
+
+        auto sqe = ctx.get_sqe();
+        if (!sqe) {
+            promise->res = -EBUSY;
+            promise->flags = 0;
+            return false;
+        }
+
+        static_cast<Derived*>(this)->prep(sqe);
+        sqe->user_data = coro_user_data(h);
+        return true;
+    }
+
+protected:
+    int result() const {
+        return promise->res;
+    }
+
+private:
+    Ctx&                      ctx;
+    uring_task::promise_type* promise = nullptr;
+};
+
+struct recv_result {
+    /* Bytes received or -errno */
+    int         res;
+    sockaddr_in src;
+};
+
+/* One datagram from the socket at fixed file index fdidx into buf, beside the multishot receive of run() */
+template <typename Ctx>
+class recv_awaitable : public ring_awaitable<Ctx, recv_awaitable<Ctx>> {
+public:
+    recv_awaitable(Ctx& ictx, int ifdidx, std::span<uint8_t> ibuf):
+        ring_awaitable<Ctx, recv_awaitable>(ictx), fdidx(ifdidx), buf(ibuf) {}
+
+    void prep(io_uring_sqe* sqe) {
+        iov = {.iov_base = buf.data(), .iov_len = buf.size()};
+        msg = {
+            .msg_name    = &src,
+            .msg_namelen = sizeof(src),
+            .msg_iov     = &iov,
+            .msg_iovlen  = 1,
+        };
+        io_uring_prep_recvmsg(sqe, fdidx, &msg, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    recv_result await_resume() const {
+        return {this->result(), src};
+    }
+
+private:
+    int                fdidx;
+    std::span<uint8_t> buf;
+    sockaddr_in        src{};
+    iovec              iov{};
+    msghdr             msg{};
+};
+
+/* data is sent in place: it has to stay valid until the co_await returns */
+template <typename Ctx>
+class send_awaitable : public ring_awaitable<Ctx, send_awaitable<Ctx>> {
+public:
+    send_awaitable(Ctx& ictx, int ifdidx, const sockaddr_in& idst, std::span<const uint8_t> idata):
+        ring_awaitable<Ctx, send_awaitable>(ictx), fdidx(ifdidx), dst(idst), data(idata) {}
+
+    void prep(io_uring_sqe* sqe) {
+        iov = {.iov_base = const_cast<uint8_t*>(data.data()), .iov_len = data.size()};
+        msg = {
+            .msg_name    = &dst,
+            .msg_namelen = sizeof(dst),
+            .msg_iov     = &iov,
+            .msg_iovlen  = 1,
+        };
+        io_uring_prep_sendmsg(sqe, fdidx, &msg, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    /* Bytes sent or -errno */
+    int await_resume() const {
+        return this->result();
+    }
+
+private:
+    int                      fdidx;
+    sockaddr_in              dst;
+    std::span<const uint8_t> data;
+    iovec                    iov{};
+    msghdr                   msg{};
+};
+
+template <typename Ctx>
+class timeout_awaitable : public ring_awaitable<Ctx, timeout_awaitable<Ctx>> {
+public:
+    timeout_awaitable(Ctx& ictx, std::chrono::nanoseconds iduration):
+        ring_awaitable<Ctx, timeout_awaitable>(ictx),
+        ts{.tv_sec = iduration.count() / 1000000000, .tv_nsec = iduration.count() % 1000000000} {}
+
+    void prep(io_uring_sqe* sqe) {
+        io_uring_prep_timeout(sqe, &ts, 0, 0);
+    }
+
+    /* 0 once the time has passed or -errno */
+    int await_resume() const {
+        auto res = this->result();
+        return res == -ETIME ? 0 : res;
+    }
+
+private:
+    __kernel_timespec ts;
+};
+
+/* Write to a regular, not registered, file descriptor. data has to stay valid until the co_await returns */
+template <typename Ctx>
+class write_awaitable : public ring_awaitable<Ctx, write_awaitable<Ctx>> {
+public:
+    write_awaitable(Ctx& ictx, int ifd, std::span<const uint8_t> idata, uint64_t ioffset):
+        ring_awaitable<Ctx, write_awaitable>(ictx), fd(ifd), data(idata), offset(ioffset) {}
+
+    void prep(io_uring_sqe* sqe) {
+        io_uring_prep_write(sqe, fd, data.data(), unsigned(data.size()), offset);
+    }
+
+    /* Bytes written or -errno */
+    int await_resume() const {
+        return this->result();
+    }
+
+private:
+    int                      fd;
+    std::span<const uint8_t> data;
+    uint64_t                 offset;
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <boost/fiber/algo/algorithm.hpp>
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/scheduler.hpp>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "uring_coro.hpp"
+#include "uring_ops.hpp"
+
+/* Set by fiber_await() for the one switch away from the calling fiber, taken back by pick_next() */
+inline thread_local bool fiber_awaiting = false;
+
+/*
+ * Boost.Fiber scheduling algorithm which runs the CQE loop of an io_uring_ctx as its idle hook. Fibers are resumed
+ * round robin; once none is ready the thread sleeps in run_once() until the next CQE, the deadline of the earliest
+ * sleeping fiber (an absolute IORING_OP_TIMEOUT) or a fiber made ready by another thread (a read of an eventfd).
+ * While fibers stay ready the ring is polled every poll_interval switches, so packets and ticks are not starved,
+ * except on the switch away from a fiber in fiber_await(): its CQE may be in the batch and it must not be made ready
+ * while still active.
+ * The fiber_* functions below suspend the calling fiber until the CQE of their SQE, switching in user space.
+ *
+ * Install it on the ring thread with boost::fibers::use_scheduling_algorithm<uring_fiber_scheduler<Ctx>>(ctx) after
+ * ctx.arm_receives() and do not call ctx.run() there: the scheduler drives the ring. The receive handler and the
+ * tick handler run in the scheduler's context and must not block, they can launch fibers or wake them. The ring has
+ * to be destroyed before the scheduler or stay unpolled after it
+ */
+template <typename Ctx>
+class uring_fiber_scheduler : public boost::fibers::algo::algorithm {
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    static constexpr unsigned poll_interval = 64;
+
+    explicit uring_fiber_scheduler(Ctx& ictx): ctx(ictx) {
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd == -1)
+            throw std::runtime_error("eventfd failed: " + std::string(strerror(errno)));
+
+        deadline_w.sched = this;
+        deadline_w.complete = [](ring_waiter& w) {
+            static_cast<sched_waiter&>(w).sched->deadline_armed = time_point::max();
+        };
+        wake_w.sched = this;
+        wake_w.complete = [](ring_waiter& w) {
+            static_cast<sched_waiter&>(w).sched->wake_armed = false;
+        };
+    }
+
+    uring_fiber_scheduler(const uring_fiber_scheduler&) = delete;
+    uring_fiber_scheduler& operator=(const uring_fiber_scheduler&) = delete;
+
+    ~uring_fiber_scheduler() override {
+        close(wake_fd);
+    }
+
+    void awakened(boost::fibers::context* fiber) noexcept override {
+        fiber->ready_link(ready);
+    }
+
+    boost::fibers::context* pick_next() noexcept override {
+        if (!std::exchange(fiber_awaiting, false) && ++switches >= poll_interval) {
+            switches = 0;
+            ctx.run_once(0);
+        }
+
+        if (ready.empty())
+            return nullptr;
+
+        auto fiber = &ready.front();
+        ready.pop_front();
+        return fiber;
+    }
+
+    bool has_ready_fibers() const noexcept override {
+        return !ready.empty();
+    }
+
+    /* Called with no fiber ready, time_point::max() if no fiber sleeps either */
+    void suspend_until(const time_point& deadline) noexcept override {
+        /* Without an SQE for the wake up or the deadline the ring is only polled and the scheduler comes back */
+        bool can_wait = wake_armed || arm_wake();
+        if (deadline != time_point::max() && deadline < deadline_armed)
+            can_wait = arm_deadline(deadline) && can_wait;
+
+        ctx.run_once(can_wait ? 1 : 0);
+    }
+
+    /* A fiber of this thread was made ready by another thread */
+    void notify() noexcept override {
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t rc = write(wake_fd, &one, sizeof(one));
+    }
+
+private:
+    struct sched_waiter : ring_waiter {
+        uring_fiber_scheduler* sched = nullptr;
+    };
+
+    bool arm_wake() {
+        auto sqe = ctx.get_sqe();
+        if (!sqe)
+            return false;
+
+        io_uring_prep_read(sqe, wake_fd, &wake_count, sizeof(wake_count), 0);
+        sqe->user_data = waiter_user_data(&wake_w);
+        wake_armed = true;
+        return true;
+    }
+
+    /* steady_clock is CLOCK_MONOTONIC, the clock of IORING_TIMEOUT_ABS. An earlier deadline still in flight
+     * completes on its own and only makes run_once() return early */
+    bool arm_deadline(time_point deadline) {
+        auto sqe = ctx.get_sqe();
+        if (!sqe)
+            return false;
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+        deadline_ts = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+        io_uring_prep_timeout(sqe, &deadline_ts, 0, IORING_TIMEOUT_ABS);
+        sqe->user_data = waiter_user_data(&deadline_w);
+        deadline_armed = deadline;
+        return true;
+    }
+
+    Ctx& ctx;
+
+    boost::fibers::scheduler::ready_queue_type ready;
+    uint64_t                                   switches = 0;
+
+    sched_waiter      deadline_w;
+    time_point        deadline_armed = time_point::max();
+    __kernel_timespec deadline_ts{};
+
+    sched_waiter wake_w;
+    int          wake_fd = -1;
+    uint64_t     wake_count = 0;
+    bool         wake_armed = false;
+};
+
+struct fiber_waiter : ring_waiter {
+    boost::fibers::context* fiber = nullptr;
+};
+
+/*
+ * Queues the SQE prepared by prep(io_uring_sqe*) and suspends the calling fiber until its CQE, the scheduler of the
+ * thread has to be uring_fiber_scheduler. Returns the result of the CQE or -EBUSY if the SQ stayed full
+ */
+template <typename Ctx, typename F>
+int fiber_await(Ctx& ctx, F&& prep) {
+    auto sqe = ctx.get_sqe();
+    if (!sqe)
+        return -EBUSY;
+
+    fiber_waiter w;
+    w.fiber = boost::fibers::context::active();
+    w.complete = [](ring_waiter& rw) {
+        boost::fibers::context::active()->schedule(static_cast<fiber_waiter&>(rw).fiber);
+    };
+
+    prep(sqe);
+    sqe->user_data = waiter_user_data(&w);
+    fiber_awaiting = true;
+    w.fiber->suspend();
+    return w.res;
+}
+
+/* One datagram from the socket at fixed file index fdidx into buf */
+template <typename Ctx>
+recv_result fiber_recv_from(Ctx& ctx, int fdidx, std::span<uint8_t> buf) {
+    recv_result result{};
+    iovec       iov = {.iov_base = buf.data(), .iov_len = buf.size()};
+    msghdr      msg = {
+        .msg_name    = &result.src,
+        .msg_namelen = sizeof(result.src),
+        .msg_iov     = &iov,
+        .msg_iovlen  = 1,
+    };
+    result.res = fiber_await(ctx, [&](io_uring_sqe* sqe) {
+        io_uring_prep_recvmsg(sqe, fdidx, &msg, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    });
+    return result;
+}
+
+/* Sends data in place, returns the bytes sent or -errno */
+template <typename Ctx>
+int fiber_send_to(Ctx& ctx, int fdidx, const sockaddr_in& dst, std::span<const uint8_t> data) {
+    auto   to = dst;
+    iovec  iov = {.iov_base = const_cast<uint8_t*>(data.data()), .iov_len = data.size()};
+    msghdr msg = {
+        .msg_name    = &to,
+        .msg_namelen = sizeof(to),
+        .msg_iov     = &iov,
+        .msg_iovlen  = 1,
+    };
+    return fiber_await(ctx, [&](io_uring_sqe* sqe) {
+        io_uring_prep_sendmsg(sqe, fdidx, &msg, 0);
+        sqe->flags |= IOSQE_FIXED_FILE;
+    });
+}
+
+/* Write to a regular, not registered, file descriptor. Returns the bytes written or -errno */
+template <typename Ctx>
+int fiber_write(Ctx& ctx, int fd, std::span<const uint8_t> data, uint64_t offset) {
+    return fiber_await(ctx, [&](io_uring_sqe* sqe) {
+        io_uring_prep_write(sqe, fd, data.data(), unsigned(data.size()), offset);
+    });
+}
@@ -1,353 +1,928 @@
 #include <arpa/inet.h>
+#include <atomic>
 #include <cerrno>
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <exception>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <variant>
+#include <vector>
 
+#include <boost/fiber/all.hpp>
 #include <iostream>
-#include <liburing.h>
 #include <netinet/in.h>
-#include <sys/mman.h>
+#include <unistd.h>
+
+#include "backpressure.hpp"
+#include "cpu_affinity.hpp"
+#include "hdr_histogram.hpp"
+#include "io_uring_ctx.hpp"
+#include "net.hpp"
+#include "session_router.hpp"
+#include "session_table.hpp"
+#include "uring_fiber.hpp"
+#include "worker_pool.hpp"
 
-int setup_sock(uint16_t port) {
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock == -1)
-        return sock;
+struct metrics_store {
+    /* Written by every worker of the pool which takes packets of the ring, read by the shard reporter */
+    std::atomic<uint64_t> packets_received = 0;
+    /* Written by the ring thread which feeds the pool, apart from dropped_oldest */
+    backpressure_metrics overflow;
+    /* With --latency: kernel receive timestamp to the CQE batch of the ring, CQE batch to the start of processing by
+     * a worker (queueing included) and processing of the packet */
+    hdr_histogram<> kernel_to_cqe;
+    hdr_histogram<> cqe_to_worker;
+    hdr_histogram<> processing;
+
+    uint64_t count_packet() {
+        return packets_received.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+};
 
-    sockaddr_in addr{
-        .sin_family = AF_INET,
-        .sin_port   = htons(port),
-        .sin_addr   = {INADDR_ANY},
-    };
+struct session_config {
+    /* Sessions one worker keeps at most, packets of further clients are processed without a session */
+    size_t  capacity = 65536;
+    int64_t idle_ms = 30000;
+};
 
-    int rc = bind(sock, (sockaddr*)&addr, sizeof(addr));
-    if (rc == -1)
-        return rc;
+/* Set by main() before any worker starts */
+session_config sessions_config;
 
-    return sock;
+struct session_state {
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+/* Milliseconds of the tick based clock, a vDSO read without the TSC */
+int64_t coarse_now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-struct printf_debug_handler {
-    template <typename... Args>
-    void operator()(auto&&... args) const {
-        fprintf(stderr, args...);
-    }
-    constexpr operator bool() const noexcept {
-        return true;
-    }
-};
+/* Nanoseconds of CLOCK_REALTIME, the clock of the kernel receive timestamps */
+int64_t realtime_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-struct metrics_store {
-    uint64_t packets_received = 0;
-};
+/* Sessions of the clients processed by this worker thread, exclusive to it with session affinity */
+session_state* touch_session(const sockaddr_in& src) {
+    thread_local session_table<session_state> sessions(sessions_config.capacity);
+    thread_local uint32_t                     touches = 0;
 
-enum sqe_op : uint64_t {
-    sqe_op_recvmsg = 1,
-    sqe_op_sendmsg,
-};
+    auto now = coarse_now_ms();
+    if (++touches % 64 == 0)
+        sessions.expire(now, sessions_config.idle_ms, 256);
+    return sessions.touch(src, now);
+}
 
-struct uring_settings {
-    uint32_t sq_depth = 32;
-    uint32_t cq_multiplier = 8;
-    uint32_t batch_size_multiplier = 2;
-    uint32_t buf_size = 4096;
-};
+void process_packet(metrics_store& metrics, int file, const sockaddr_in& src, const uint8_t* payload, size_t size) {
+    auto     session = touch_session(src);
+    uint64_t session_packets = 0;
+    if (session) {
+        session_packets = ++session->packets;
+        session->bytes += size;
+    }
+
+    char str[INET_ADDRSTRLEN + 1] = {0};
+    inet_ntop(AF_INET, &src.sin_addr, str, sizeof(str));
+    printf("ipaddr: %s:%i (socket %d, packet %zu of the session)\n", str, ntohs(src.sin_port), file, session_packets);
+    printf("receive: %.*s\n", int(size), payload);
 
-template <auto V>
-struct type_c {};
+    auto received = metrics.count_packet();
+    if (received % 1000 == 0)
+        fprintf(stderr, "received: %zu\n", received);
+}
 
-template <uring_settings settings, typename RH, typename DH = printf_debug_handler>
-class io_uring_ctx {
+/* Set by main() before any worker starts */
+backpressure_config overflow_config;
+pool_config         workers_config;
+/* Packets of a client always go to the same worker, workers do not steal */
+bool session_affinity = true;
+
+/*
+ * Ring thread side of the worker pool, one per ring: applies the overflow policies and queues the packets on the
+ * workers of the pool shared by all rings
+ */
+template <typename T>
+class worker {
 public:
-    static constexpr auto sq_depth = settings.sq_depth;
-    static constexpr auto cq_depth = sq_depth * settings.cq_multiplier;
-    static constexpr auto batch_size = cq_depth * settings.batch_size_multiplier;
-    static constexpr auto buf_size = settings.buf_size;
-    static constexpr auto buf_ring_size = (sizeof(io_uring_buf) + buf_size) * batch_size;
-
-    io_uring_ctx(type_c<settings>, RH receive_handler, DH debug_handler = printf_debug_handler{}):
-        receive_h(std::move(receive_handler)), debug(std::move(debug_handler)) {
-        setup();
-    }
-
-    int register_files(int* fds, unsigned int count) {
-        int rc = io_uring_register_files(&ring, fds, count);
-        if (rc)
-            debug("register file failed: %s\n", strerror(-rc));
-        return rc;
-    }
-
-    void add_recv_request(int idx) {
-        io_uring_sqe* sqe = next_sqe();
-        io_uring_prep_recvmsg_multishot(sqe, idx, &msg, MSG_TRUNC);
-        sqe->flags |= IOSQE_FIXED_FILE;
-        sqe->flags |= IOSQE_BUFFER_SELECT;
-        sqe->buf_group = 0;
-        sqe->user_data = sqe_op_recvmsg;
-    }
-
-    void run() {
-        while (true) {
-            add_recv_request(0);
-            auto rc = io_uring_submit_and_wait(&ring, 1);
-            if (rc == -EINTR) {
-                fprintf(stderr, "EINTR\n");
-                continue;
-            }
+    /* Copy slots fit every datagram of the ring, as many of them as fit into copy_memory (at most 4096) */
+    static constexpr size_t copy_memory = 8 << 20;
+    static constexpr auto   copy_slot_size = uint32_t(T::max_size());
+    using pool_type = copy_pool<uint32_t(std::clamp<size_t>(copy_memory / copy_slot_size, 64, 4096)), copy_slot_size>;
+    using payload_type = std::variant<T, typename pool_type::buffer>;
+
+    /* Packets of one ring queued in the pool at most */
+    static constexpr size_t queue_size = 512;
+
+    struct data {
+        int file;
+        sockaddr_in src;
+        uint64_t seq;
+        size_t client;
+        size_t session;
+        payload_type buf;
+        worker* owner;
+        /* CQE batch time of the packet, 0 without receive timestamps */
+        int64_t cqe_ns;
+    };
+
+    struct consume_fn {
+        void operator()(data&& d) const {
+            d.owner->consume(std::move(d));
+        }
+    };
+
+    using workers_type = worker_pool<data, consume_fn>;
 
-            if (rc < 0) {
-                debug("io_uring_submit_and_wait() failed: %d\n", rc);
+    /* The packets queued in the pool point to this worker */
+    ~worker() {
+        drain();
+    }
+
+    /* Waits until the workers are done with every packet of the ring, and so with its buffers */
+    void drain() const {
+        while (inflight.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+    /* Called by the ring thread, never blocks: above the high watermark the overflow policy decides the fate of the
+     * packet and a full queue drops it */
+    void push(int file, sockaddr_in src, T&& buf) {
+        auto&        overflow = metrics.overflow;
+        auto         client = client_shed_table::bucket(src);
+        auto         cqe_ns = buf.cqe_ns;
+        if (cqe_ns && buf.rx_ns)
+            metrics.kernel_to_cqe.record(cqe_ns - buf.rx_ns);
+        payload_type payload = std::move(buf);
+        auto         queued = inflight.load(std::memory_order_relaxed);
+
+        if (queued >= overflow_config.high_watermark) {
+            switch (overflow_config.policy) {
+            case overflow_policy::drop_newest: break;
+            case overflow_policy::drop_oldest:
+                drop_before.store(seq - overflow_config.high_watermark / 2, std::memory_order_relaxed);
+                break;
+            case overflow_policy::copy:
+                if (auto copy = pool.copy(std::get<T>(payload).data(), std::get<T>(payload).size())) {
+                    payload = std::move(*copy);
+                    backpressure_metrics::add(overflow.copied);
+                    break;
+                }
+                backpressure_metrics::add(overflow.dropped_newest);
+                return;
+            case overflow_policy::shed_client:
+                if (clients.queued(client) >= overflow_config.client_limit) {
+                    backpressure_metrics::add(overflow.shed);
+                    return;
+                }
                 break;
             }
+        }
 
-            auto count = io_uring_peek_batch_cqe(&ring, cqes, cq_depth /* batch_size */);
-            //fprintf(stderr, "batch: %zu\n", count);
-            for (size_t i = 0; i < count; ++i)
-                rc = process_cqe(cqes[i], 0);
+        if (queued >= queue_size) {
+            backpressure_metrics::add(overflow.dropped_newest);
+            return;
+        }
+
+        size_t target = seq;
+        size_t session = 0;
+        if (session_affinity) {
+            session = session_router::bucket(src);
+            target = router().route(session);
+        }
 
-            //buf_ring_advance(int(count));
-            io_uring_cq_advance(&ring, count);
+        clients.add(client);
+        inflight.fetch_add(1, std::memory_order_relaxed);
+        if (!workers().push(target, data{file, src, seq, client, session, std::move(payload), this, cqe_ns})) {
+            /* The lane of the ring on that worker is full, the packet was destroyed with the temporary */
+            clients.remove(client);
+            if (session_affinity)
+                router().done(session);
+            inflight.fetch_sub(1, std::memory_order_relaxed);
+            backpressure_metrics::add(overflow.dropped_newest);
+            return;
         }
+        ++seq;
+        backpressure_metrics::add(overflow.queued);
     }
 
-    uint8_t* buffer(size_t idx) {
-        return ((uint8_t*)buf_ring + sizeof(io_uring_buf) * batch_size) + idx * buf_size;
+    const metrics_store& stats() const {
+        return metrics;
+    }
+
+    /* Started on first use with workers_config */
+    static workers_type& workers() {
+        static workers_type w(workers_config, consume_fn{});
+        return w;
+    }
+
+    /* Shared by all rings, so a client keeps its worker whichever ring receives its packets */
+    static session_router& router() {
+        static session_router r(uint32_t(workers().size()));
+        return r;
+    }
+
+    /* One per ring thread: every shard keeps its own overflow state and metrics */
+    static worker& instance() {
+        thread_local worker w;
+        return w;
     }
 
 private:
-    void setup() {
-        io_uring_params params = {
-            .cq_entries = cq_depth,
-            .flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE,
-        };
-        auto rc = io_uring_queue_init_params(sq_depth, &ring, &params);
-        if (rc < 0)
-            throw std::runtime_error("queue_init failed: " + std::string(strerror(-rc)));
-
-        try {
-            setup_buffer();
+    /* Any worker thread of the pool */
+    void consume(data&& d) {
+        if (d.seq < drop_before.load(std::memory_order_relaxed))
+            metrics.overflow.dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+        else {
+            auto [payload, size] = std::visit([](auto& b) { return std::pair{b.data(), b.size()}; }, d.buf);
+            if (d.cqe_ns) {
+                auto start = realtime_ns();
+                metrics.cqe_to_worker.record(start - d.cqe_ns);
+                process_packet(metrics, d.file, d.src, payload, size);
+                metrics.processing.record(realtime_ns() - start);
+            }
+            else
+                process_packet(metrics, d.file, d.src, payload, size);
         }
-        catch (...) {
-            io_uring_queue_exit(&ring);
-            throw;
+
+        clients.remove(d.client);
+        if (session_affinity)
+            router().done(d.session);
+        /* The buffer goes back before the ring can see the packet done and go away */
+        {
+            auto done = std::move(d.buf);
         }
+        inflight.fetch_sub(1, std::memory_order_release);
     }
 
-    void setup_buffer() {
-        buf_ring =
-            (io_uring_buf_ring*)mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
-        if (buf_ring == MAP_FAILED)
-            throw std::runtime_error("buffer ring mmap failed: " + std::string(strerror(errno)));
+    metrics_store metrics;
 
-        io_uring_buf_ring_init(buf_ring);
+    /* Ring thread side of the overflow policies */
+    uint64_t seq = 0;
+    pool_type pool;
+    client_shed_table clients;
+    std::atomic<size_t> inflight = 0;
+    /* Packets with a lower seq are dropped by the workers */
+    std::atomic<uint64_t> drop_before = 0;
+};
 
-        io_uring_buf_reg reg = {
-            .ring_addr = (uint64_t)buf_ring,
-            .ring_entries = batch_size,
-            .bgid = 0,
-        };
+/*
+ * Ring thread side of the pool fed with whole CQE batches: the ring thread publishes once per batch and a worker
+ * walks the arrays of the batch in order. A full queue drops the whole batch, the overflow policies apply to
+ * per-packet handoff only. A batch mixes clients, so there is no session affinity: main() rejects --batch without
+ * --spread
+ */
+template <typename B>
+class batch_worker {
+public:
+    /* Batches of one ring queued in the pool at most */
+    static constexpr size_t queue_size = 64;
 
-        auto rc = io_uring_register_buf_ring(&ring, &reg, 0);
-        if (rc)
-            throw std::runtime_error("buffer ring init failed: " + std::string(strerror(-rc)));
+    struct task {
+        B             batch;
+        batch_worker* owner;
+    };
 
-        for (uint16_t i = 0; i < batch_size; ++i)
-            io_uring_buf_ring_add(buf_ring, buffer(i), buf_size, i, io_uring_buf_ring_mask(batch_size), i);
+    struct consume_fn {
+        void operator()(task&& t) const {
+            t.owner->consume(std::move(t.batch));
+        }
+    };
 
-        buf_ring_advance(int(batch_size));
-    }
+    using workers_type = worker_pool<task, consume_fn>;
 
-    void buf_ring_recycle(size_t idx) {
-        io_uring_buf_ring_add(buf_ring,
-                              buffer(idx),
-                              buf_size,
-                              uint16_t(idx),
-                              io_uring_buf_ring_mask(batch_size),
-                              0);
+    ~batch_worker() {
+        drain();
     }
 
-    void buf_ring_advance(int count) {
-        io_uring_buf_ring_advance(buf_ring, count);
+    /* Waits until the workers are done with every batch of the ring */
+    void drain() const {
+        while (inflight.load(std::memory_order_acquire))
+            std::this_thread::yield();
     }
 
-    io_uring_sqe* next_sqe() {
-        if (auto sqe = io_uring_get_sqe(&ring))
-            return sqe;
-
-        debug("cannot get SQE: SQ is full, trying submit it to get next SQE...\n");
-        io_uring_submit(&ring);
+    /* Called by the ring thread, never blocks */
+    void push(B&& batch) {
+        auto count = batch->count;
+        if (batch->cqe_ns)
+            for (uint32_t i = 0; i < count; ++i)
+                if (batch->rx_ns[i])
+                    metrics.kernel_to_cqe.record(batch->cqe_ns - batch->rx_ns[i]);
+
+        if (inflight.load(std::memory_order_relaxed) >= queue_size) {
+            backpressure_metrics::add(metrics.overflow.dropped_newest, count);
+            return;
+        }
 
-        if (auto sqe = io_uring_get_sqe(&ring))
-            return sqe;
+        inflight.fetch_add(1, std::memory_order_relaxed);
+        if (!workers().push(seq++, task{std::move(batch), this})) {
+            inflight.fetch_sub(1, std::memory_order_relaxed);
+            backpressure_metrics::add(metrics.overflow.dropped_newest, count);
+            return;
+        }
+        backpressure_metrics::add(metrics.overflow.queued, count);
+    }
 
-        debug("cannot get SQE\n");
-        return nullptr;
+    const metrics_store& stats() const {
+        return metrics;
     }
 
-    struct buf_scope {
-        buf_scope(): ctx(nullptr) {}
+    static workers_type& workers() {
+        static workers_type w(workers_config, consume_fn{});
+        return w;
+    }
 
-        buf_scope(uint8_t* ipayload, size_t ilen, size_t iidx, io_uring_ctx* ictx):
-            payload(ipayload), len(ilen), idx(iidx), ctx(ictx) {}
+    static batch_worker& instance() {
+        thread_local batch_worker w;
+        return w;
+    }
 
-        buf_scope(buf_scope&& bs) noexcept: payload(bs.payload), len(bs.len), idx(bs.idx), ctx(bs.ctx) {
-            bs.ctx = nullptr;
+private:
+    void consume(B&& batch) {
+        auto& b = *batch;
+        if (b.cqe_ns) {
+            /* A packet waits for the ones before it in the batch as well */
+            auto start = realtime_ns();
+            for (uint32_t i = 0; i < b.count; ++i) {
+                metrics.cqe_to_worker.record(start - b.cqe_ns);
+                process_packet(metrics, b.file[i], b.src[i], b.data[i], b.len[i]);
+                auto end = realtime_ns();
+                metrics.processing.record(end - start);
+                start = end;
+            }
+        }
+        else
+            for (uint32_t i = 0; i < b.count; ++i)
+                process_packet(metrics, b.file[i], b.src[i], b.data[i], b.len[i]);
+        /* The buffers of the batch go back before the ring can see the batch done and go away */
+        {
+            auto done = std::move(batch);
         }
+        inflight.fetch_sub(1, std::memory_order_release);
+    }
 
-        buf_scope& operator=(buf_scope&& bs) noexcept {
-            if (&bs == this)
-                return *this;
+    metrics_store metrics;
+    uint64_t seq = 0;
+    std::atomic<size_t> inflight = 0;
+};
 
-            payload = bs.payload;
-            len = bs.len;
-            idx = bs.idx;
-            ctx = bs.ctx;
-            bs.ctx = nullptr;
-            return *this;
-        }
+/* Receive handler of the server rings, per packet or per batch depending on uring_settings::recv_batches */
+struct to_worker {
+    void operator()(int file, sockaddr_in* src, auto&& buf) const {
+        worker<std::remove_reference_t<decltype(buf)>>::instance().push(file, *src, std::move(buf));
+    }
 
-        ~buf_scope() {
-            if (ctx) {
-                ctx->buf_ring_recycle(idx);
-                ctx->buf_ring_advance(1);
-            }
-        }
+    void operator()(auto&& batch) const {
+        batch_worker<std::remove_reference_t<decltype(batch)>>::instance().push(std::move(batch));
+    }
+};
 
-        const uint8_t* data() const {
-            return payload;
-        }
+enum class buffer_mode {
+    regular,
+    small,
+    incremental,
+};
 
-        size_t size() const {
-            return len;
-        }
+struct server_options {
+    /* Every shard listens on all ports, socket i of a ring is bound to ports[i] */
+    std::vector<uint16_t> ports;
+    bool        sharded = false;
+    size_t      shards_count = 0;
+    bool        cpu_steering = false;
+    bool        udp_gro = false;
+    buffer_mode buffers = buffer_mode::regular;
+    bool        hugepages = false;
+    bool        batches = false;
+    /* Kernel receive timestamps and latency histograms */
+    bool        latency = false;
+    /* Worker threads of the pool, 0 - one per shard */
+    size_t      workers = 0;
+    /* Game ticks per second of every ring, 0 - no ticks */
+    uint32_t    tick_hz = 0;
+    /* Match fibers of every ring, 0 - the ring runs without the fiber scheduler */
+    size_t      matches = 0;
+};
 
-        uint8_t*      payload;
-        size_t        len;
-        size_t        idx;
-        io_uring_ctx* ctx;
-    };
+/* A GRO super-packet carries up to 64KB of payload plus the recvmsg header, name and control */
+constexpr uring_settings gro_settings{.batch_size_multiplier = 1, .buf_size = 65536 + 256, .udp_gro = true};
 
-    int process_cqe_recv(io_uring_cqe* cqe, int /*fdidx*/) {
-        if (cqe->res == -ENOBUFS) {
-            debug("no buffers available\n");
-            return 0;
-        }
+/* Input packets are mostly under 128 bytes: 256 bytes fit them together with the recvmsg header and name */
+constexpr uring_settings small_buf_settings{
+    .buf_classes    = {buf_class{.size = 256, .count = 8192}},
+    .stats_interval = 65536,
+};
 
-        if (!(cqe->flags & IORING_CQE_F_BUFFER) || cqe->res < 0) {
-            debug("recv CQE have a bad res: %d\n", cqe->res);
-            return -55;
-        }
-        auto idx = cqe->flags >> 16;
+/* Small datagrams are packed one after another into 64KB buffers. The datagram which does not fit into the rest of a
+ * buffer is lost, about one per buffer, counted in recv_truncated_tail */
+constexpr uring_settings inc_buf_settings{
+    .buf_classes     = {buf_class{.size = 65536, .count = 32}},
+    .buf_incremental = true,
+    .stats_interval  = 65536,
+};
 
-        io_uring_recvmsg_out* out = io_uring_recvmsg_validate(buffer(idx), cqe->res, &msg);
-        if (!out) {
-            debug("bad recvmsg\n");
-            return -2;
-        }
+/* Buffer rings on hugetlb pages (transparent huge pages if the pool is empty) of the shard's NUMA node */
+constexpr uring_settings with_hugepages(uring_settings settings) {
+    settings.buf_backing = mem_backing::hugetlb;
+    settings.buf_numa_local = true;
+    return settings;
+}
 
-        auto payload_len = io_uring_recvmsg_payload_length(out, cqe->res, &msg);
-        if (out->flags & MSG_TRUNC) {
-            debug("truncated msg need %u received %u\n", out->payloadlen, payload_len);
-            buf_ring_recycle(idx);
-            buf_ring_advance(1);
-            return 0;
-        }
+/* Up to 8 CQE batches in flight between a ring and its worker */
+constexpr uring_settings with_batches(uring_settings settings) {
+    settings.recv_batches = 8;
+    return settings;
+}
 
-        auto payload = io_uring_recvmsg_payload(out, &msg);
-        auto src = (sockaddr_in*)io_uring_recvmsg_name(out);
+/* SO_TIMESTAMPNS of every datagram, for the latency histograms */
+constexpr uring_settings with_timestamps(uring_settings settings) {
+    settings.recv_timestamps = true;
+    return settings;
+}
 
-        receive_h(src, buf_scope{(uint8_t*)payload, payload_len, idx, this});
+struct shard {
+    size_t           id;
+    int              cpu;
+    std::vector<int> sockfds;
+    std::thread      thread;
+
+    /* metrics points to the thread_local worker front end of the ring thread. The ring thread returns only on
+     * failure, and then clears metrics and sets failed under the lock before its thread_locals go away */
+    std::mutex           metrics_lock;
+    const metrics_store* metrics = nullptr;
+    bool                 failed = false;
+
+    uint32_t tick_hz = 0;
+    /* Tick counters of the ring, published by the ring thread on every tick */
+    std::atomic<uint64_t> ticks = 0;
+    std::atomic<uint64_t> tick_overruns = 0;
+    std::atomic<uint64_t> tick_jitter_max_ns = 0;
+
+    size_t                matches = 0;
+    std::atomic<uint64_t> match_ticks = 0;
+};
+
+std::chrono::nanoseconds tick_period(uint32_t hz) {
+    return std::chrono::nanoseconds(1000000000 / hz);
+}
+
+/* Match fibers tick at --tick-hz or at this rate without ring ticks */
+constexpr uint32_t default_match_hz = 60;
+
+/*
+ * Runs the ring under uring_fiber_scheduler together with matches fibers, each one a match loop ticking at hz.
+ * Match starts are spread over one period so their ticks do not all fall on the same deadline. Never returns
+ */
+template <typename Ctx>
+void run_matches(Ctx& ctx, size_t matches, uint32_t hz, std::atomic<uint64_t>& ticks) {
+    ctx.arm_receives();
+    boost::fibers::use_scheduling_algorithm<uring_fiber_scheduler<Ctx>>(ctx);
+
+    auto period = tick_period(hz);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<boost::fibers::fiber> fibers;
+    fibers.reserve(matches);
+    for (size_t i = 0; i < matches; ++i)
+        fibers.emplace_back([next = start + period * i / matches, period, &ticks]() mutable {
+            while (true) {
+                next += period;
+                boost::this_fiber::sleep_until(next);
+                ticks.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
 
-        //ring_recycle(idx);
-        //buf_ring_advance(1);
+    for (auto& f : fibers)
+        f.join();
+}
 
-        return 0;
+/* Starts the worker pool on first use, returns the metrics of the worker front end of the calling ring thread */
+template <typename Ctx>
+const metrics_store& start_workers() {
+    if constexpr (Ctx::batch_handoff) {
+        using worker_t = batch_worker<typename Ctx::batch_type>;
+        worker_t::workers();
+        return worker_t::instance().stats();
+    }
+    else {
+        using worker_t = worker<typename Ctx::buffer_type>;
+        worker_t::workers();
+        return worker_t::instance().stats();
     }
+}
 
-    int process_cqe(io_uring_cqe* cqe, int fdidx) {
-        if (cqe->user_data == sqe_op_recvmsg)
-            return process_cqe_recv(cqe, fdidx);
-        return -1;
+/* Declared right after the ring: waits on destruction until the pool is done with the packets of the calling ring
+ * thread, which hold buffers of the ring */
+template <typename Ctx>
+struct workers_drain {
+    ~workers_drain() {
+        if constexpr (Ctx::batch_handoff)
+            batch_worker<typename Ctx::batch_type>::instance().drain();
+        else
+            worker<typename Ctx::buffer_type>::instance().drain();
     }
+};
 
-private:
-    io_uring ring = {};
-    io_uring_buf_ring* buf_ring;
-    io_uring_cqe* cqes[cq_depth];
+/* Snapshots of the latency histograms taken by the previous report */
+struct latency_report {
+    hdr_snapshot<> kernel_to_cqe;
+    hdr_snapshot<> cqe_to_worker;
+    hdr_snapshot<> processing;
+};
 
-    msghdr msg = {.msg_namelen = sizeof(sockaddr_in)};
+/* Percentiles of the latencies recorded since the previous report */
+void print_latency(const metrics_store& metrics, latency_report& prev) {
+    auto print = [](const char* name, const hdr_snapshot<>& cur, hdr_snapshot<>& last) {
+        auto interval = cur - last;
+        last = cur;
+        fprintf(stderr,
+                "[%s p50 %.1f p99 %.1f p99.9 %.1f max %.1f us] ",
+                name,
+                double(interval.quantile(0.5)) / 1000.0,
+                double(interval.quantile(0.99)) / 1000.0,
+                double(interval.quantile(0.999)) / 1000.0,
+                double(interval.max()) / 1000.0);
+    };
+    print("kernel-cqe", metrics.kernel_to_cqe.snapshot(), prev.kernel_to_cqe);
+    print("cqe-worker", metrics.cqe_to_worker.snapshot(), prev.cqe_to_worker);
+    print("processing", metrics.processing.snapshot(), prev.processing);
+}
 
-    RH receive_h;
-    DH debug;
-};
+template <uring_settings settings>
+void run_shard(shard& s) {
+    using ctx_t = decltype(io_uring_ctx(type_c<settings>{}, to_worker{}));
 
-#include "rigtorp/SPSCQueue.h"
+    /* The ring thread returns only on failure */
+    struct shard_exit {
+        shard& s;
 
-template <typename T>
-class worker {
-public:
-    struct data {
-        sockaddr_in src;
-        T buf;
-    };
+        ~shard_exit() {
+            std::lock_guard lock(s.metrics_lock);
+            s.metrics = nullptr;
+            s.failed = true;
+        }
+    } guard{s};
 
-    worker() {
-        t = std::thread(&worker::run, this);
+    /* Start the pool before pinning so workers without --worker-cpus do not inherit the ring thread's CPU */
+    {
+        auto& metrics = start_workers<ctx_t>();
+        std::lock_guard lock(s.metrics_lock);
+        s.metrics = &metrics;
     }
 
-    ~worker() {
-        t.join();
+    if (auto rc = pin_thread_to_cpu(s.cpu))
+        fprintf(stderr, "shard %zu: cannot pin to cpu %d: %s\n", s.id, s.cpu, strerror(rc));
+
+    try {
+        ctx_t                ctx(type_c<settings>{}, to_worker{});
+        workers_drain<ctx_t> drain;
+        if (ctx.register_files(s.sockfds.data(), unsigned(s.sockfds.size()))) {
+            fprintf(stderr, "shard %zu: cannot register the sockets\n", s.id);
+            return;
+        }
+        if (s.tick_hz)
+            ctx.start_ticks(tick_period(s.tick_hz), [&](const auto&) {
+                auto& m = ctx.stats();
+                s.ticks.store(m.ticks, std::memory_order_relaxed);
+                s.tick_overruns.store(m.tick_overruns, std::memory_order_relaxed);
+                s.tick_jitter_max_ns.store(m.tick_jitter_max_ns, std::memory_order_relaxed);
+            });
+        if (s.matches)
+            run_matches(ctx, s.matches, s.tick_hz ? s.tick_hz : default_match_hz, s.match_ticks);
+        else
+            ctx.run();
+    }
+    catch (const std::exception& e) {
+        fprintf(stderr, "shard %zu: %s\n", s.id, e.what());
+    }
+}
+
+template <uring_settings settings>
+int run_sharded(const server_options& opts) {
+    auto shards_count = opts.shards_count;
+    auto cpus = allowed_cpus();
+    if (cpus.empty()) {
+        std::cerr << "sched_getaffinity() failed: " << strerror(errno) << std::endl;
+        return 1;
     }
+    if (shards_count == 0)
+        shards_count = cpus.size();
 
-    void push(sockaddr_in src, T&& data) {
-        spsc.emplace(src, std::move(data));
+    if (opts.cpu_steering && shards_count > cpus.size()) {
+        std::cerr << "cpu steering needs at most one shard per CPU (" << cpus.size() << " allowed)" << std::endl;
+        return 1;
     }
 
-    void run() {
-        while (true) {
-            auto data = spsc.front();
-            if (!data) {
-                std::this_thread::yield();
-                //std::this_thread::sleep_for(std::chrono::microseconds(5));
-                continue;
+    std::vector<int> shard_cpus(shards_count);
+    for (size_t i = 0; i < shards_count; ++i)
+        shard_cpus[i] = cpus[i % cpus.size()];
+
+    /* Sockets are bound in shard order so the reuseport group index of every port matches the shard id */
+    std::vector<shard> shards(shards_count);
+    for (size_t i = 0; i < shards_count; ++i) {
+        auto& s = shards[i];
+        s.id = i;
+        s.cpu = shard_cpus[i];
+        s.tick_hz = opts.tick_hz;
+        s.matches = opts.matches;
+        for (auto port : opts.ports) {
+            auto sockfd = setup_sock(port,
+                                     {
+                                         .reuseport     = true,
+                                         .steering_cpus = opts.cpu_steering
+                                                              ? std::span<const int>(shard_cpus.data(), i + 1)
+                                                              : std::span<const int>{},
+                                         .udp_gro       = opts.udp_gro,
+                                         .rx_timestamps = opts.latency,
+                                     });
+            if (sockfd == -1) {
+                std::cerr << "setup_sock() failed for shard " << i << " port " << port << ": " << strerror(errno)
+                          << std::endl;
+                return 1;
             }
+            s.sockfds.push_back(sockfd);
+        }
+    }
+
+    if (opts.workers == 0)
+        workers_config.workers = shards_count;
+    workers_config.producers = shards_count;
+
+    for (auto& s : shards)
+        s.thread = std::thread(run_shard<settings>, std::ref(s));
+
+    std::vector<uint64_t>       last(shards_count, 0);
+    std::vector<latency_report> last_latency(opts.latency ? shards_count : 0);
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        uint64_t total = 0;
+        bool     failed = false;
+        for (auto& s : shards) {
+            std::lock_guard lock(s.metrics_lock);
+            failed = failed || s.failed;
+            auto metrics = s.metrics;
+            auto received = metrics ? metrics->packets_received.load(std::memory_order_relaxed) : 0;
+            fprintf(stderr, "[%zu@cpu%d] %zu (+%zu) ", s.id, s.cpu, received, received - last[s.id]);
+            if (s.failed)
+                fprintf(stderr, "[failed] ");
+            if (metrics) {
+                auto& o = metrics->overflow;
+                fprintf(stderr,
+                        "[copied %zu dropped %zu/%zu shed %zu] ",
+                        o.copied.load(std::memory_order_relaxed),
+                        o.dropped_newest.load(std::memory_order_relaxed),
+                        o.dropped_oldest.load(std::memory_order_relaxed),
+                        o.shed.load(std::memory_order_relaxed));
+            }
+            if (s.tick_hz)
+                fprintf(stderr,
+                        "[ticks %zu overruns %zu jitter max %zu us] ",
+                        s.ticks.load(std::memory_order_relaxed),
+                        s.tick_overruns.load(std::memory_order_relaxed),
+                        s.tick_jitter_max_ns.load(std::memory_order_relaxed) / 1000);
+            if (metrics && opts.latency)
+                print_latency(*metrics, last_latency[s.id]);
+            if (s.matches)
+                fprintf(stderr,
+                        "[matches %zu ticks %zu] ",
+                        s.matches,
+                        s.match_ticks.load(std::memory_order_relaxed));
+            last[s.id] = received;
+            total += received;
+        }
+        fprintf(stderr, "total: %zu\n", total);
 
-            char str[INET_ADDRSTRLEN + 1] = {0};
-            inet_ntop(AF_INET, &data->src.sin_addr, str, sizeof(str));
-            printf("ipaddr: %s:%i\n", str, ntohs(data->src.sin_port));
-            printf("receive: %.*s\n", int(data->buf.size()), data->buf.data());
+        if (failed) {
+            /* The other rings have no way to stop, end the process without running destructors under them */
+            fprintf(stderr, "a shard failed, exiting\n");
+            std::quick_exit(1);
+        }
+    }
+}
+
+template <uring_settings settings>
+int run_server(const server_options& opts) {
+    if constexpr (settings.buf_backing == mem_backing::regular) {
+        if (opts.hugepages)
+            return run_server<with_hugepages(settings)>(opts);
+    }
+    if constexpr (settings.recv_batches == 0) {
+        if (opts.batches)
+            return run_server<with_batches(settings)>(opts);
+    }
+    if constexpr (!settings.recv_timestamps) {
+        if (opts.latency)
+            return run_server<with_timestamps(settings)>(opts);
+    }
 
-            ++metrics.packets_received;
-            if (metrics.packets_received % 1000 == 0)
-                fprintf(stderr, "received: %zu\n", metrics.packets_received);
+    /* A full size IPv4 datagram on a 1500 byte MTU link */
+    constexpr size_t ethernet_datagram = 1472;
+    using ctx_t = decltype(io_uring_ctx(type_c<settings>{}, to_worker{}));
+    if constexpr (!settings.buf_incremental && ctx_t::max_datagram(0) < ethernet_datagram)
+        fprintf(stderr, "datagrams over %zu bytes are dropped as truncated\n", ctx_t::max_datagram(0));
 
-            spsc.pop();
+    if (opts.sharded)
+        return run_sharded<settings>(opts);
+
+    io_uring_ctx                 ctx(type_c<settings>{}, to_worker{});
+    workers_drain<decltype(ctx)> drain;
+
+    std::vector<int> sockfds;
+    for (auto port : opts.ports) {
+        auto sockfd = setup_sock(port, {.udp_gro = opts.udp_gro, .rx_timestamps = opts.latency});
+        if (sockfd == -1) {
+            std::cerr << "setup_sock() failed for port " << port << ": " << strerror(errno) << std::endl;
+            return 1;
         }
+        sockfds.push_back(sockfd);
     }
 
-    static worker& instance() {
-        static worker w;
-        return w;
+    if (ctx.register_files(sockfds.data(), unsigned(sockfds.size())))
+        return 1;
+
+    std::jthread reporter;
+    if (opts.latency)
+        reporter = std::jthread([metrics = &start_workers<decltype(ctx)>()](std::stop_token stop) {
+            latency_report prev;
+            while (!stop.stop_requested()) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                print_latency(*metrics, prev);
+                fprintf(stderr, "\n");
+            }
+        });
+
+    if (opts.tick_hz)
+        ctx.start_ticks(tick_period(opts.tick_hz), [&](const auto& tick) {
+            if (tick.tick % opts.tick_hz)
+                return;
+            auto& m = ctx.stats();
+            fprintf(stderr,
+                    "ticks %zu overruns %zu skipped %zu jitter avg %.1f us max %.1f us\n",
+                    m.ticks,
+                    m.tick_overruns,
+                    m.ticks_skipped,
+                    m.ticks ? double(m.tick_jitter_sum_ns) / double(m.ticks) / 1000.0 : 0.0,
+                    double(m.tick_jitter_max_ns) / 1000.0);
+        });
+    if (opts.matches) {
+        std::atomic<uint64_t> match_ticks = 0;
+        run_matches(ctx, opts.matches, opts.tick_hz ? opts.tick_hz : default_match_hz, match_ticks);
     }
+    else
+        ctx.run();
+    return 0;
+}
 
-private:
-    rigtorp::SPSCQueue<data> spsc{512};
-    std::thread t;
-    metrics_store metrics;
-};
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0
+              << " [--port PORT]... [--shards N [--cpu-steering]] [--gro | --buffers small|incremental]"
+              << " [--hugepages] [--batch] [--workers N] [--worker-cpus CPU,...] [--spread]"
+              << " [--spin N] [--yield N] [--park none|futex|eventfd] [--sessions N] [--session-idle S]"
+              << " [--tick-hz HZ] [--matches N] [--latency]\n"
+              << "  --port PORT     listen on PORT (default 1337), repeat to serve several ports from every ring\n"
+              << "  --shards N      run N pinned ring threads on SO_REUSEPORT sockets (0 - one per allowed CPU)\n"
+              << "  --cpu-steering  deliver each packet to the shard pinned to the CPU which received it\n"
+              << "  --gro           receive UDP GRO super-packets into 64KB buffers\n"
+              << "  --buffers MODE  small: 256 byte buffers, datagrams over 224 bytes (192 with --latency) are\n"
+              << "                  truncated and dropped, incremental: datagrams share 64KB buffers (kernel 6.12+),\n"
+              << "                  a datagram longer than the rest of a buffer is lost, about one per buffer\n"
+              << "  --hugepages     back the buffer rings with huge pages of the ring thread's NUMA node\n"
+              << "  --batch         hand every CQE batch to the worker at once instead of packet by packet, needs\n"
+              << "                  --spread: a batch mixes clients, so they cannot keep their worker and sessions\n"
+              << "  --overflow P    worker queue above --watermark N (default 384 of 512): drop-newest (default),\n"
+              << "                  drop-oldest, copy (into a secondary pool, releasing the provided buffer),\n"
+              << "                  shed-client (drop clients with --client-limit N packets queued, default 8)\n"
+              << "  --workers N     worker threads shared by all rings (default one per shard)\n"
+              << "  --worker-cpus L pin worker i to the i-th CPU of the comma separated list L\n"
+              << "  --spread        queue packets round robin and let idle workers steal instead of keeping every\n"
+              << "                  client on one worker, a client then has a session on every worker\n"
+              << "  --sessions N    client sessions every worker keeps (default 65536), expired after\n"
+              << "                  --session-idle S seconds without packets (default 30)\n"
+              << "  --tick-hz HZ    run game ticks HZ times a second on every ring (e.g. 60 or 128), reporting the\n"
+              << "                  tick jitter and overruns\n"
+              << "  --matches N     run N match fibers on every ring, ticking at --tick-hz (default 60), with the\n"
+              << "                  ring driven by the fiber scheduler\n"
+              << "  --latency       timestamp packets in the kernel and report p50/p99/p99.9/max of kernel to CQE,\n"
+              << "                  CQE to worker and processing time every second\n"
+              << "  --spin N        idle worker polls N times with a pause (default 2000), then --yield N times\n"
+              << "                  with sched_yield() (default 64), then parks: on a futex (default), an eventfd\n"
+              << "                  or never (--park none)"
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    server_options opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--port" && i + 1 < argc)
+            opts.ports.push_back(uint16_t(std::stoul(argv[++i])));
+        else if (arg == "--shards" && i + 1 < argc) {
+            opts.sharded = true;
+            opts.shards_count = std::stoul(argv[++i]);
+        }
+        else if (arg == "--cpu-steering")
+            opts.cpu_steering = true;
+        else if (arg == "--gro")
+            opts.udp_gro = true;
+        else if (arg == "--hugepages")
+            opts.hugepages = true;
+        else if (arg == "--batch")
+            opts.batches = true;
+        else if (arg == "--latency")
+            opts.latency = true;
+        else if (arg == "--workers" && i + 1 < argc) {
+            opts.workers = std::stoul(argv[++i]);
+            workers_config.workers = opts.workers;
+        }
+        else if (arg == "--worker-cpus" && i + 1 < argc) {
+            workers_config.cpus = parse_cpu_list(argv[++i]);
+            if (workers_config.cpus.empty()) {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--sessions" && i + 1 < argc)
+            sessions_config.capacity = std::stoul(argv[++i]);
+        else if (arg == "--session-idle" && i + 1 < argc)
+            sessions_config.idle_ms = int64_t(std::stoul(argv[++i])) * 1000;
+        else if (arg == "--tick-hz" && i + 1 < argc)
+            opts.tick_hz = uint32_t(std::stoul(argv[++i]));
+        else if (arg == "--matches" && i + 1 < argc)
+            opts.matches = std::stoul(argv[++i]);
+        else if (arg == "--spread")
+            session_affinity = false;
+        else if (arg == "--spin" && i + 1 < argc)
+            workers_config.wait.spin = uint32_t(std::stoul(argv[++i]));
+        else if (arg == "--yield" && i + 1 < argc)
+            workers_config.wait.yield = uint32_t(std::stoul(argv[++i]));
+        else if (arg == "--park" && i + 1 < argc) {
+            auto park = parse_park_mode(argv[++i]);
+            if (!park) {
+                usage(argv[0]);
+                return 1;
+            }
+            workers_config.wait.park = *park;
+        }
+        else if (arg == "--overflow" && i + 1 < argc) {
+            auto policy = parse_overflow_policy(argv[++i]);
+            if (!policy) {
+                usage(argv[0]);
+                return 1;
+            }
+            overflow_config.policy = *policy;
+        }
+        else if (arg == "--watermark" && i + 1 < argc)
+            overflow_config.high_watermark = uint32_t(std::stoul(argv[++i]));
+        else if (arg == "--client-limit" && i + 1 < argc)
+            overflow_config.client_limit = uint32_t(std::stoul(argv[++i]));
+        else if (arg == "--buffers" && i + 1 < argc) {
+            std::string_view mode = argv[++i];
+            if (mode == "small")
+                opts.buffers = buffer_mode::small;
+            else if (mode == "incremental")
+                opts.buffers = buffer_mode::incremental;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-int main() {
-    io_uring_ctx ctx(type_c<uring_settings{}>{}, [&](sockaddr_in* src, auto&& buf) {
-        worker<std::remove_reference_t<decltype(buf)>>::instance().push(*src, std::move(buf));
-    });
+    if (opts.ports.empty())
+        opts.ports.push_back(1337);
+    if (opts.batches && session_affinity) {
+        std::cerr << "--batch needs --spread: a CQE batch mixes clients of different workers" << std::endl;
+        return 1;
+    }
+    workers_config.stealing = !session_affinity;
 
-    auto sockfd = setup_sock(1337);
-    if (sockfd == -1) {
-        std::cerr << "setup_sock() failed: " << strerror(errno) << std::endl;
+    if ((opts.cpu_steering && !opts.sharded) || (opts.udp_gro && opts.buffers != buffer_mode::regular)) {
+        usage(argv[0]);
         return 1;
     }
 
-    ctx.register_files(&sockfd, 1);
-    ctx.run();
+    if (opts.udp_gro)
+        return run_server<gro_settings>(opts);
+
+    switch (opts.buffers) {
+    case buffer_mode::small: return run_server<small_buf_settings>(opts);
+    case buffer_mode::incremental: return run_server<inc_buf_settings>(opts);
+    case buffer_mode::regular: break;
+    }
+    return run_server<uring_settings{}>(opts);
 }
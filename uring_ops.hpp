@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+
+#include <liburing.h>
+
+enum sqe_op : uint8_t {
+    sqe_op_recvmsg = 1,
+    sqe_op_sendmsg,
+    sqe_op_send_zc,
+    sqe_op_tick,
+    /* user_data is the frame address of a uring_task coroutine, see uring_coro.hpp */
+    sqe_op_coro,
+    /* user_data is the address of a ring_waiter */
+    sqe_op_waiter,
+    /* First op free for op_handler: timers, accepts, file writes... */
+    sqe_op_user = 16,
+};
+
+/* user_data layout: | tag (40 bits) | fixed file index (16 bits) | op (8 bits) | */
+template <sqe_op Op>
+struct op_data {
+    static constexpr sqe_op   op = Op;
+    static constexpr unsigned fdidx_shift = 8;
+    static constexpr unsigned tag_shift = 24;
+    static constexpr uint64_t max_tag = (uint64_t(1) << (64 - tag_shift)) - 1;
+
+    uint16_t fdidx = 0;
+    uint64_t tag = 0;
+
+    constexpr uint64_t encode() const {
+        return uint64_t(op) | uint64_t(fdidx) << fdidx_shift | tag << tag_shift;
+    }
+
+    static constexpr op_data decode(uint64_t user_data) {
+        return {.fdidx = uint16_t(user_data >> fdidx_shift), .tag = user_data >> tag_shift};
+    }
+};
+
+constexpr sqe_op user_data_op(uint64_t user_data) {
+    return sqe_op(user_data & 0xff);
+}
+
+static_assert([] {
+    constexpr op_data<sqe_op_user> d{.fdidx = 0xffff, .tag = op_data<sqe_op_user>::max_tag};
+    auto decoded = op_data<sqe_op_user>::decode(d.encode());
+    return user_data_op(d.encode()) == sqe_op_user && decoded.fdidx == d.fdidx && decoded.tag == d.tag;
+}());
+
+/*
+ * Completion callback for code suspended on an SQE outside of the coroutine API (fibers, hand-written state machines):
+ * embed it into the waiting object, tag the SQE with waiter_user_data() and complete() is called from the CQE loop
+ * with res and flags of the CQE. The waiter must stay alive until then
+ */
+struct ring_waiter {
+    void (*complete)(ring_waiter&) = nullptr;
+    int      res = 0;
+    uint32_t flags = 0;
+};
+
+/* | waiter address (56 bits) | op (8 bits) |, userspace addresses of 64-bit Linux fit into 56 bits */
+inline uint64_t waiter_user_data(ring_waiter* waiter) {
+    static_assert(sizeof(void*) == 8);
+    return uint64_t(reinterpret_cast<uintptr_t>(waiter)) << 8 | sqe_op_waiter;
+}
+
+inline ring_waiter* user_data_waiter(uint64_t user_data) {
+    return reinterpret_cast<ring_waiter*>(uintptr_t(user_data >> 8));
+}
+
+/* Handles the CQEs of a user-defined op: int f(io_uring_cqe*, op_data<Op>) */
+template <sqe_op Op, typename F>
+struct op_handler {
+    static constexpr sqe_op op = Op;
+
+    F f;
+
+    int operator()(io_uring_cqe* cqe) {
+        return f(cqe, op_data<Op>::decode(cqe->user_data));
+    }
+};
+
+template <sqe_op Op, typename F>
+op_handler<Op, F> on_op(F f) {
+    return {std::move(f)};
+}
+
+/*
+ * Compile-time dispatch table of op handlers. The op of a CQE is compared against the op of every entry and the
+ * matching handler is called directly: with the handlers inlined the dispatch is a chain of compares, so adding an
+ * op adds neither an indirect call nor a lookup
+ */
+template <typename... Hs>
+class op_table {
+public:
+    static_assert(((Hs::op >= sqe_op_user) && ...), "ops below sqe_op_user are handled by io_uring_ctx itself");
+    static_assert(
+        [] {
+            std::array<sqe_op, sizeof...(Hs)> ops = {Hs::op...};
+            for (size_t i = 0; i < ops.size(); ++i)
+                for (size_t j = i + 1; j < ops.size(); ++j)
+                    if (ops[i] == ops[j])
+                        return false;
+            return true;
+        }(),
+        "every op must have one handler");
+
+    op_table(Hs... ihandlers): handlers(std::move(ihandlers)...) {}
+
+    /* Returns false if no entry handles the op of the CQE */
+    bool dispatch(io_uring_cqe* cqe, int& rc) {
+        auto op = user_data_op(cqe->user_data);
+        return [&]<size_t... I>(std::index_sequence<I...>) {
+            return ((op == Hs::op && (rc = std::get<I>(handlers)(cqe), true)) || ...);
+        }(std::index_sequence_for<Hs...>{});
+    }
+
+private:
+    std::tuple<Hs...> handlers;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Where an idle consumer sleeps once spinning and yielding found nothing */
+enum class park_mode : uint8_t {
+    /* Never sleeps, keeps yielding */
+    none,
+    futex,
+    /* Blocks in read() on an eventfd, which an io_uring or epoll loop can wait on as well */
+    eventfd,
+};
+
+inline std::optional<park_mode> parse_park_mode(std::string_view name) {
+    if (name == "none")
+        return park_mode::none;
+    if (name == "futex")
+        return park_mode::futex;
+    if (name == "eventfd")
+        return park_mode::eventfd;
+    return {};
+}
+
+struct wait_config {
+    /* Polls with a pause instruction in between before yielding */
+    uint32_t  spin = 2000;
+    /* Polls with sched_yield() in between before parking */
+    uint32_t  yield = 64;
+    park_mode park = park_mode::futex;
+};
+
+inline void spin_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+ * Spin, yield, park wait of one consumer thread. The producer calls notify() after publishing, which costs a fence
+ * and a load while the consumer is awake and a syscall only when it is parked:
+ *   consumer: parked = 1, fence, check the queue again, sleep
+ *   producer: publish,    fence, read parked, wake if it was set
+ * Either the consumer sees the new entry or the producer sees parked, so no wakeup is lost.
+ */
+class idle_waiter {
+public:
+    explicit idle_waiter(wait_config iconfig = {}): config(iconfig) {
+        if (config.park == park_mode::eventfd) {
+            efd = eventfd(0, EFD_CLOEXEC);
+            if (efd == -1)
+                throw std::runtime_error("eventfd failed: " + std::string(strerror(errno)));
+        }
+    }
+
+    idle_waiter(const idle_waiter&) = delete;
+    idle_waiter& operator=(const idle_waiter&) = delete;
+
+    ~idle_waiter() {
+        if (efd != -1)
+            close(efd);
+    }
+
+    /* Consumer side: returns once ready() is true */
+    template <typename F>
+    void wait(F&& ready) {
+        while (true) {
+            for (uint32_t i = 0; i < config.spin; ++i) {
+                if (ready())
+                    return;
+                spin_pause();
+            }
+
+            for (uint32_t i = 0; i < config.yield || config.park == park_mode::none; ++i) {
+                if (ready())
+                    return;
+                std::this_thread::yield();
+            }
+
+            parked.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready()) {
+                parked.store(0, std::memory_order_relaxed);
+                return;
+            }
+
+            parks.store(parks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            sleep();
+        }
+    }
+
+    /* Producer side, after the entry is published */
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed) == 0 || parked.exchange(0, std::memory_order_relaxed) == 0)
+            return;
+
+        if (config.park == park_mode::eventfd) {
+            /* Cannot fail, at most one write per park reaches the counter before the consumer reads it */
+            uint64_t                  one = 1;
+            [[maybe_unused]] ssize_t rc = write(efd, &one, sizeof(one));
+        }
+        else
+            syscall(SYS_futex, &parked, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+    /* Times the consumer went to sleep */
+    uint64_t parks_count() const {
+        return parks.load(std::memory_order_relaxed);
+    }
+
+    const wait_config& settings() const {
+        return config;
+    }
+
+private:
+    void sleep() {
+        if (config.park == park_mode::eventfd) {
+            /* A stale count left by a notify() racing with the parked check only makes the next sleep return early */
+            uint64_t count;
+            while (read(efd, &count, sizeof(count)) == -1 && errno == EINTR)
+                ;
+            parked.store(0, std::memory_order_relaxed);
+            return;
+        }
+
+        /* Returns at once if notify() has already cleared parked */
+        while (parked.load(std::memory_order_relaxed) == 1)
+            syscall(SYS_futex, &parked, FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+    wait_config config;
+    int         efd = -1;
+
+    std::atomic<uint32_t> parked = 0;
+    std::atomic<uint64_t> parks = 0;
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "cpu_affinity.hpp"
+#include "wait_strategy.hpp"
+
+struct pool_config {
+    /* Worker threads, 0 is taken as 1 */
+    size_t           workers = 1;
+    /* Worker i is pinned to cpus[i % cpus.size()], workers are not pinned if empty */
+    std::vector<int> cpus;
+    /* Threads (rings) which queue tasks. Each gets its own lane on every worker until they run out, then lanes are
+     * shared */
+    size_t           producers = 1;
+    /* Tasks one lane holds, rounded up to a power of two. A push into a full lane fails */
+    size_t           lane_capacity = 512;
+    /* Tasks queued on one worker above which idle workers steal from it */
+    size_t           steal_threshold = 4;
+    /* Off when tasks must run on the worker they were queued on */
+    bool             stealing = true;
+    wait_config      wait;
+};
+
+/*
+ * Bounded lock-free queue of tasks: Vyukov's MPMC queue holding move-only objects. A lane normally has one producer,
+ * its consumers are the worker which owns it and the workers stealing from it
+ */
+template <typename T>
+class task_lane {
+public:
+    explicit task_lane(size_t icapacity):
+        capacity(uint32_t(std::bit_ceil(icapacity))), cells(std::make_unique<cell[]>(capacity)) {
+        for (uint32_t i = 0; i < capacity; ++i)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    task_lane(const task_lane&) = delete;
+    task_lane& operator=(const task_lane&) = delete;
+
+    ~task_lane() {
+        while (pop([](T&&) {}))
+            ;
+    }
+
+    /* Returns false and leaves task untouched if the lane is full */
+    bool push(T&& task) {
+        auto pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = cells[pos & (capacity - 1)];
+            auto  diff = int32_t(c.seq.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+
+        auto& c = cells[pos & (capacity - 1)];
+        new (&c.task) T(std::move(task));
+        c.seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Moves the oldest task out of the lane and passes it to f, the cell is free again before f runs */
+    template <typename F>
+    bool pop(F&& f) {
+        auto pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = cells[pos & (capacity - 1)];
+            auto  diff = int32_t(c.seq.load(std::memory_order_acquire) - (pos + 1));
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+
+        auto& c = cells[pos & (capacity - 1)];
+        T     task(std::move(c.task));
+        c.task.~T();
+        c.seq.store(pos + capacity, std::memory_order_release);
+        f(std::move(task));
+        return true;
+    }
+
+private:
+    /* task is alive between a push and the pop of the cell */
+    struct cell {
+        cell() {}
+        ~cell() {}
+
+        std::atomic<uint32_t> seq;
+        union {
+            T task;
+        };
+    };
+
+    uint32_t                capacity;
+    std::unique_ptr<cell[]> cells;
+
+    alignas(64) std::atomic<uint32_t> tail = 0;
+    alignas(64) std::atomic<uint32_t> head = 0;
+};
+
+/*
+ * Pool of worker threads, each one owning a lock-free lane per producer. A producer queues a task on the worker
+ * picked by a hint, the owner takes the tasks of its lanes in order, visiting the producers round robin. A worker
+ * with nothing to do pops tasks from the lanes of a worker which has more than steal_threshold tasks queued, and
+ * pushing past the threshold wakes the next worker to do that, so a burst on one worker spreads over the idle ones.
+ * Neither side takes a lock, a producer never waits for a consumer.
+ * Destroying the pool stops the workers after their current task, tasks left in the lanes are destroyed.
+ */
+template <typename Task, typename F>
+class worker_pool {
+public:
+    worker_pool(pool_config iconfig, F iprocess): config(std::move(iconfig)), process(std::move(iprocess)) {
+        auto count = config.workers ? config.workers : 1;
+        producers = config.producers ? config.producers : 1;
+        for (size_t i = 0; i < count; ++i)
+            workers.push_back(std::make_unique<worker_state>(config.wait));
+        for (size_t i = 0; i < count * producers; ++i)
+            lanes.push_back(std::make_unique<task_lane<Task>>(config.lane_capacity));
+        for (size_t i = 0; i < count; ++i)
+            workers[i]->thread = std::thread(&worker_pool::run, this, i);
+    }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    ~worker_pool() {
+        stop();
+    }
+
+    void stop() {
+        stopping.store(true, std::memory_order_relaxed);
+        for (auto& w : workers) {
+            w->waiter.notify();
+            if (w->thread.joinable())
+                w->thread.join();
+        }
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    /* Any thread, never blocks. Returns false and leaves task untouched if the lane of the calling thread on the
+     * worker is full */
+    bool push(size_t hint, Task&& task) {
+        thread_local producer_claim claim;
+        if (claim.pool != this) {
+            claim.pool = this;
+            claim.producer = next_producer.fetch_add(1, std::memory_order_relaxed) % producers;
+        }
+
+        auto idx = hint % workers.size();
+        auto& w = *workers[idx];
+        /* Counted before the task becomes visible, so a consumer never takes queued below zero */
+        auto queued = w.queued.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (!lane(claim.producer, idx).push(std::move(task))) {
+            w.queued.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        w.waiter.notify();
+
+        if (config.stealing && queued > config.steal_threshold && workers.size() > 1)
+            workers[(idx + 1) % workers.size()]->waiter.notify();
+        return true;
+    }
+
+    uint64_t steals_count() const {
+        uint64_t total = 0;
+        for (auto& w : workers)
+            total += w->steals.load(std::memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct worker_state {
+        worker_state(wait_config wait): waiter(wait) {}
+
+        /* Tasks in the lanes of the worker, an upper bound while pushes are in progress */
+        std::atomic<size_t>   queued = 0;
+        std::atomic<uint64_t> steals = 0;
+        idle_waiter           waiter;
+        std::thread           thread;
+        /* Producer whose lane the worker looks at first next time */
+        size_t                next_lane = 0;
+    };
+
+    struct producer_claim {
+        const worker_pool* pool = nullptr;
+        size_t             producer = 0;
+    };
+
+    task_lane<Task>& lane(size_t producer, size_t worker) {
+        return *lanes[producer * workers.size() + worker];
+    }
+
+    void run(size_t idx) {
+        if (!config.cpus.empty()) {
+            auto cpu = config.cpus[idx % config.cpus.size()];
+            if (auto rc = pin_thread_to_cpu(cpu))
+                fprintf(stderr, "worker %zu: cannot pin to cpu %d: %s\n", idx, cpu, strerror(rc));
+        }
+
+        auto& w = *workers[idx];
+        while (true) {
+            w.waiter.wait([&] {
+                return stopping.load(std::memory_order_relaxed) || w.queued.load(std::memory_order_relaxed) ||
+                       victim(idx) != no_victim;
+            });
+            if (stopping.load(std::memory_order_relaxed))
+                return;
+
+            if (!take(idx))
+                steal(idx);
+        }
+    }
+
+    /* Processes the next task of the worker's own lanes */
+    bool take(size_t idx) {
+        auto& w = *workers[idx];
+        for (size_t i = 0; i < producers; ++i) {
+            auto producer = w.next_lane;
+            w.next_lane = (w.next_lane + 1) % producers;
+            if (pop(producer, idx))
+                return true;
+        }
+        return false;
+    }
+
+    bool pop(size_t producer, size_t owner) {
+        return lane(producer, owner).pop([&](Task&& task) {
+            workers[owner]->queued.fetch_sub(1, std::memory_order_relaxed);
+            process(std::move(task));
+        });
+    }
+
+    static constexpr size_t no_victim = SIZE_MAX;
+
+    size_t victim(size_t idx) const {
+        if (!config.stealing)
+            return no_victim;
+        for (size_t i = 1; i < workers.size(); ++i) {
+            auto v = (idx + i) % workers.size();
+            if (workers[v]->queued.load(std::memory_order_relaxed) > config.steal_threshold)
+                return v;
+        }
+        return no_victim;
+    }
+
+    /* Processes the oldest task of one of the victim's lanes */
+    bool steal(size_t idx) {
+        auto v = victim(idx);
+        if (v == no_victim)
+            return false;
+
+        for (size_t producer = 0; producer < producers; ++producer)
+            if (pop(producer, v)) {
+                workers[idx]->steals.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        return false;
+    }
+
+    pool_config config;
+    F           process;
+    size_t      producers = 1;
+
+    std::vector<std::unique_ptr<worker_state>> workers;
+    /* Lane of producer p on worker w at p * workers + w */
+    std::vector<std::unique_ptr<task_lane<Task>>> lanes;
+    std::atomic<size_t>                            next_producer = 0;
+    std::atomic<bool>                              stopping = false;
+};
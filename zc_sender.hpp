@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <liburing.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+#include "uring_ops.hpp"
+
+struct zc_metrics {
+    uint64_t sends_completed = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t send_errors = 0;
+    /* Notifications received: each of them returns one buffer reference */
+    uint64_t notifications = 0;
+    /* Notifications reporting that the kernel had to copy the data anyway (e.g. loopback) */
+    uint64_t kernel_copied = 0;
+};
+
+/*
+ * Pool of registered snapshot buffers sent with IORING_OP_SEND_ZC.
+ *
+ * The same snapshot usually goes to many clients, so a buffer is reference counted: acquire() hands out the owner
+ * reference, every queued send takes one more and gives it back when the kernel posts its IORING_CQE_F_NOTIF
+ * completion. The buffer returns to the free list when the owner has called release() and the last notification
+ * has arrived, i.e. when the kernel no longer reads from it.
+ */
+template <uint32_t BuffersCount, uint32_t BufSize, uint32_t SendDepth>
+class zc_sender {
+public:
+    static constexpr auto buffers_count = BuffersCount;
+    static constexpr auto buf_size = BufSize;
+    static constexpr auto send_depth = SendDepth;
+    static constexpr auto pool_size = size_t(buffers_count) * buf_size;
+
+    static_assert(buffers_count > 0 && buffers_count <= UINT16_MAX, "buffers_count must fit into uint16_t");
+    static_assert(send_depth > 0 && send_depth <= UINT16_MAX, "send_depth must fit into uint16_t");
+
+    zc_sender() = default;
+    zc_sender(const zc_sender&) = delete;
+    zc_sender& operator=(const zc_sender&) = delete;
+
+    ~zc_sender() {
+        if (pool)
+            munmap(pool, pool_size);
+    }
+
+    /* Maps the pool and registers every buffer as a fixed buffer of the ring, buffer index == snapshot id */
+    void setup(io_uring* ring) {
+        auto mapped = mmap(nullptr, pool_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+        if (mapped == MAP_FAILED)
+            throw std::runtime_error("zero-copy pool mmap failed: " + std::string(strerror(errno)));
+        pool = (uint8_t*)mapped;
+
+        iovec iovs[buffers_count];
+        for (uint32_t i = 0; i < buffers_count; ++i)
+            iovs[i] = {.iov_base = buffer(i), .iov_len = buf_size};
+
+        auto rc = io_uring_register_buffers(ring, iovs, buffers_count);
+        if (rc)
+            throw std::runtime_error("zero-copy buffers registration failed: " + std::string(strerror(-rc)));
+
+        for (uint32_t i = 0; i < buffers_count; ++i)
+            free_buffers[i] = uint16_t(buffers_count - 1 - i);
+        free_buffers_count = buffers_count;
+
+        for (uint32_t i = 0; i < send_depth; ++i)
+            free_slots[i] = uint16_t(send_depth - 1 - i);
+        free_slots_count = send_depth;
+    }
+
+    /* Returns a snapshot id whose buffer can be filled, or -EAGAIN if every buffer is still in use */
+    int acquire() {
+        if (free_buffers_count == 0)
+            return -EAGAIN;
+
+        auto id = free_buffers[--free_buffers_count];
+        refs[id] = 1;
+        return id;
+    }
+
+    /* Drops the owner reference: no more sends of this snapshot will be queued */
+    void release(uint16_t id) {
+        unref(id);
+    }
+
+    uint8_t* buffer(size_t id) {
+        return pool + id * buf_size;
+    }
+
+    bool can_send() const {
+        return free_slots_count != 0;
+    }
+
+    /* Prepares a zero-copy send of the first len bytes of snapshot id to dst through the fixed file fdidx.
+     * The caller checks can_send() and len <= buf_size before taking the SQE */
+    void send(io_uring_sqe* sqe, int fdidx, uint16_t id, size_t len, const sockaddr_in& dst) {
+        auto  slot_idx = free_slots[--free_slots_count];
+        auto& slot = slots[slot_idx];
+        slot.dst = dst;
+        slot.buf_id = id;
+        ++refs[id];
+
+        io_uring_prep_send_zc_fixed(sqe, fdidx, buffer(id), len, 0, zc_flags, id);
+        io_uring_prep_send_set_addr(sqe, (const sockaddr*)&slot.dst, sizeof(slot.dst));
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->user_data = op_data<sqe_op_send_zc>{.fdidx = uint16_t(fdidx), .tag = slot_idx}.encode();
+    }
+
+    /* Handles both the send result and the notification CQE of a send */
+    int process_cqe(io_uring_cqe* cqe) {
+        auto  slot_idx = uint16_t(op_data<sqe_op_send_zc>::decode(cqe->user_data).tag);
+        auto& slot = slots[slot_idx];
+
+        if (cqe->flags & IORING_CQE_F_NOTIF) {
+            ++metrics.notifications;
+#ifdef IORING_NOTIF_USAGE_ZC_COPIED
+            if (uint32_t(cqe->res) & IORING_NOTIF_USAGE_ZC_COPIED)
+                ++metrics.kernel_copied;
+#endif
+            finish(slot_idx, slot);
+            return 0;
+        }
+
+        int rc = 0;
+        if (cqe->res < 0) {
+            ++metrics.send_errors;
+            rc = cqe->res;
+            /* Kernels before 6.2 reject IORING_SEND_ZC_REPORT_USAGE, the next sends go without it */
+            if (rc == -EINVAL && zc_flags)
+                zc_flags = 0;
+        }
+        else {
+            ++metrics.sends_completed;
+            metrics.bytes_sent += uint64_t(cqe->res);
+        }
+
+        /* Without IORING_CQE_F_MORE no notification will follow */
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            finish(slot_idx, slot);
+
+        return rc;
+    }
+
+    const zc_metrics& stats() const {
+        return metrics;
+    }
+
+private:
+    struct send_slot {
+        sockaddr_in dst;
+        uint16_t    buf_id;
+    };
+
+    void finish(uint16_t slot_idx, const send_slot& slot) {
+        unref(slot.buf_id);
+        free_slots[free_slots_count++] = slot_idx;
+    }
+
+    void unref(uint16_t id) {
+        if (--refs[id] == 0)
+            free_buffers[free_buffers_count++] = id;
+    }
+
+private:
+    uint8_t* pool = nullptr;
+
+#ifdef IORING_SEND_ZC_REPORT_USAGE
+    /* Makes the notification of a send the kernel had to copy carry IORING_NOTIF_USAGE_ZC_COPIED */
+    unsigned zc_flags = IORING_SEND_ZC_REPORT_USAGE;
+#else
+    unsigned zc_flags = 0;
+#endif
+
+    uint32_t refs[buffers_count] = {};
+    uint16_t free_buffers[buffers_count];
+    uint32_t free_buffers_count = 0;
+
+    send_slot slots[send_depth];
+    uint16_t  free_slots[send_depth];
+    uint32_t  free_slots_count = 0;
+
+    zc_metrics metrics;
+};